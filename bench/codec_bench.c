@@ -0,0 +1,166 @@
+/* codec_bench - throughput of the ramdisk compression formats
+ *
+ * usage: codec_bench [<file> [<runs>]]
+ *
+ * Compresses and decompresses file (an uncompressed cpio archive, say,
+ * from abootimg --pack-initrd --compress none) in every built in format,
+ * through the streaming interface with 256 KB buffers, and checks that the
+ * data comes back. Without a file, 32 MB of generated data, half text and
+ * half random, is used.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "compress.h"
+
+#define BUF             (256 << 10)
+
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static char* load(const char* fname, size_t* size)
+{
+  FILE* f = fopen(fname, "r");
+  char* data = NULL;
+  size_t len = 0, rb;
+
+  if (!f)
+    return NULL;
+  do {
+    char* more = realloc(data, len + BUF);
+    if (!more) {
+      free(data);
+      fclose(f);
+      return NULL;
+    }
+    data = more;
+    len += rb = fread(data + len, 1, BUF, f);
+  } while (rb == BUF);
+  fclose(f);
+  *size = len;
+  return data;
+}
+
+static char* generate(size_t* size)
+{
+  size_t len = 32 << 20, i = 0;
+  char* data = malloc(len + 32);
+
+  if (!data)
+    return NULL;
+  while (i < len / 2)
+    i += sprintf(data + i, "%zu\n", i * 7);
+  for (; i < len; i++)
+    data[i] = rand();
+  *size = len;
+  return data;
+}
+
+
+/*
+ * Runs data through a codec, BUF bytes at a time. Returns the output
+ * size, or -1.
+ */
+static long run(int fmt, int encode, const char* in, size_t len, char* out, size_t size)
+{
+  t_codec c;
+  int ret;
+
+  if (codec_init(&c, fmt, encode, 0))
+    return -1;
+  c.next_out = out;
+  do {
+    if (!c.avail_in && len) {
+      c.next_in = in;
+      c.avail_in = len < BUF ? len : BUF;
+      in += c.avail_in;
+      len -= c.avail_in;
+    }
+    size_t room = out + size - c.next_out;
+    if (!room) {
+      c.error = "output too large";
+      ret = -1;
+      break;
+    }
+    c.avail_out = room < BUF ? room : BUF;
+    ret = codec_run(&c, !len);
+  } while (!ret);
+
+  long done = ret == 1 ? c.next_out - out : -1;
+  if (ret < 0)
+    fprintf(stderr, "%s: %s\n", fmt_name(fmt), c.error ? c.error : "out of memory");
+  codec_end(&c);
+  return done;
+}
+
+int main(int argc, char** argv)
+{
+  int runs = argc > 2 ? atoi(argv[2]) : 3;
+  size_t len;
+  char* data = argc > 1 ? load(argv[1], &len) : generate(&len);
+  int fmt, i;
+
+  if (!data || (runs < 1)) {
+    perror(argc > 1 ? argv[1] : "codec_bench");
+    return 1;
+  }
+
+  size_t size = len + len / 8 + (1 << 20);
+  char* packed = malloc(size);
+  char* back = malloc(len + 1);
+  if (!packed || !back) {
+    perror("codec_bench");
+    return 1;
+  }
+
+  printf("%zu bytes, best of %d\n", len, runs);
+  printf("format   ratio   compress  decompress\n");
+  for (fmt = 0; fmt < nformats; fmt++) {
+    double enc = 0, dec = 0;
+    long plen = 0, blen = 0;
+
+    if (!fmt_supported(fmt)) {
+      printf("%-8s not built in\n", fmt_name(fmt));
+      continue;
+    }
+
+    for (i = 0; i < runs; i++) {
+      double t0 = now();
+      plen = run(fmt, 1, data, len, packed, size);
+      double t1 = now();
+      blen = plen < 0 ? -1 : run(fmt, 0, packed, plen, back, len + 1);
+      double t2 = now();
+      if ((plen < 0) || (blen < 0))
+        break;
+      if (!i || (t1 - t0 < enc))
+        enc = t1 - t0;
+      if (!i || (t2 - t1 < dec))
+        dec = t2 - t1;
+    }
+
+    if ((plen < 0) || (blen != (long)len) || memcmp(data, back, len)) {
+      printf("%-8s round trip FAILED\n", fmt_name(fmt));
+      return 1;
+    }
+    printf("%-8s %5.3f %7.1f MB/s %7.1f MB/s\n", fmt_name(fmt), (double)plen / len,
+           len / enc / 1e6, len / dec / 1e6);
+  }
+
+  free(data);
+  free(packed);
+  free(back);
+  return 0;
+}
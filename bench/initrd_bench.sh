@@ -0,0 +1,84 @@
+#!/bin/sh
+# initrd_bench - abootimg-pack-initrd (find | cpio | gzip) vs --pack-initrd
+#
+# usage: bench/initrd_bench.sh [<files> [<runs>]]
+#
+# Packs a generated tree of small files (10000 by default) both ways, then
+# with --pack-initrd in each of the formats compressed in parallel (gzip,
+# lz4 and xz, or $FORMATS) on 1, 2, 4... threads up to one per CPU (or up
+# to $CPUS), checking that the archive is the same whatever the number of
+# threads and that --unpack-initrd gives the tree back.
+
+set -e
+
+ABOOTIMG=${ABOOTIMG:-./abootimg}
+PACK_INITRD=${PACK_INITRD:-./abootimg-pack-initrd}
+FORMATS=${FORMATS:-gzip lz4 xz}
+FILES=${1:-10000}
+RUNS=${2:-5}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# 100 directories of small files, plus a few larger ones and symlinks
+mkdir "$TMP/ramdisk"
+i=0
+while [ "$i" -lt "$FILES" ]; do
+  d=$TMP/ramdisk/d$((i % 100))
+  [ -d "$d" ] || mkdir "$d"
+  echo "file $i" > "$d/f$i"
+  i=$((i + 1))
+done
+head -c 4000000 /dev/urandom > "$TMP/ramdisk/d0/blob"
+seq 4000000 > "$TMP/ramdisk/d1/text"
+ln -s d0/blob "$TMP/ramdisk/link"
+
+run() {
+  name=$1
+  shift
+  best=
+  for i in $(seq "$RUNS"); do
+    rm -f "$TMP/initrd.img"
+    t0=$(date +%s%N)
+    "$@" "$TMP/initrd.img" "$TMP/ramdisk" >/dev/null
+    t1=$(date +%s%N)
+    ms=$(( (t1 - t0) / 1000000 ))
+    if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+      best=$ms
+    fi
+  done
+  size=$(wc -c < "$TMP/initrd.img")
+  printf "%-20s %6d ms (best of %d), %d bytes\n" "$name" "$best" "$RUNS" "$size"
+}
+
+echo "$FILES files"
+if command -v cpio >/dev/null; then
+  run abootimg-pack-initrd "$PACK_INITRD"
+else
+  echo "cpio not found, skipping abootimg-pack-initrd"
+fi
+run --pack-initrd "$ABOOTIMG" --pack-initrd
+
+cpus=${CPUS:-$(nproc)}
+for fmt in $FORMATS; do
+  if ! "$ABOOTIMG" --pack-initrd -f --compress "$fmt" "$TMP/initrd.img" "$TMP/ramdisk" >/dev/null 2>&1; then
+    echo "$fmt: not built in, skipping"
+    continue
+  fi
+  j=1
+  while [ "$j" -le "$cpus" ]; do
+    run "$fmt -j $j" "$ABOOTIMG" --pack-initrd -j "$j" --compress "$fmt"
+    if [ "$j" -eq 1 ]; then
+      mv "$TMP/initrd.img" "$TMP/initrd.1.img"
+    elif ! cmp -s "$TMP/initrd.img" "$TMP/initrd.1.img"; then
+      echo "$fmt -j $j: archive differs from -j 1"
+      exit 1
+    fi
+    j=$((j * 2))
+  done
+  rm -rf "$TMP/back"
+  "$ABOOTIMG" --unpack-initrd "$TMP/initrd.1.img" "$TMP/back" >/dev/null
+  if ! diff -r "$TMP/ramdisk" "$TMP/back" >/dev/null; then
+    echo "$fmt: unpacked tree differs"
+    exit 1
+  fi
+done
@@ -0,0 +1,142 @@
+/* lib_bench - libabootimg calls in process vs one abootimg process per image
+ *
+ * usage: lib_bench [<abootimg> [<runs>]]
+ *
+ * Creates a small boot image in a scratch directory, then runs -i and -x
+ * on it runs times through abootimg_run, and as many times through
+ * fork/exec of the abootimg command (./abootimg by default).
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "libabootimg.h"
+
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void quiet(void* ctx, int level, const char* msg)
+{
+}
+
+static int run_in_process(int argc, char** argv)
+{
+  t_abootimg_io io = { NULL, quiet, NULL };
+  t_abootimg* img = abootimg_new(&io);
+  int ret = -1;
+
+  if (img) {
+    int cmd = abootimg_parse_args(img, argc, argv);
+    ret = cmd > cmd_help ? abootimg_run(img, cmd) : -1;
+    if (ret)
+      fprintf(stderr, "%s\n", abootimg_strerror(img));
+    abootimg_free(img);
+  }
+  return ret;
+}
+
+static int run_process(const char* abootimg, char** argv)
+{
+  int status;
+  pid_t pid = fork();
+
+  if (pid == -1)
+    return -1;
+  if (!pid) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    dup2(null, 2);
+    execv(abootimg, argv);
+    _exit(127);
+  }
+  if (waitpid(pid, &status, 0) == -1)
+    return -1;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static int write_random(const char* fname, size_t size)
+{
+  FILE* f = fopen(fname, "w");
+  size_t i;
+
+  if (!f)
+    return -1;
+  for (i = 0; i < size; i++)
+    putc(rand(), f);
+  return fclose(f);
+}
+
+
+static void bench(const char* name, const char* abootimg, int runs, int argc, char** argv)
+{
+  double t, lib, proc;
+  int i;
+
+  t = now();
+  for (i = 0; i < runs; i++)
+    if (run_in_process(argc, argv))
+      exit(1);
+  lib = (now() - t) / runs;
+
+  t = now();
+  for (i = 0; i < runs; i++)
+    if (run_process(abootimg, argv)) {
+      fprintf(stderr, "%s failed\n", abootimg);
+      exit(1);
+    }
+  proc = (now() - t) / runs;
+
+  printf("%-4s  in process %8.1f us   fork/exec %8.1f us   (x%.1f)\n",
+         name, lib * 1e6, proc * 1e6, proc / lib);
+}
+
+int main(int argc, char** argv)
+{
+  char abootimg[4096];
+  char dir[] = "/tmp/lib_bench.XXXXXX";
+  int runs = argc > 2 ? atoi(argv[2]) : 1000;
+
+  if (!realpath(argc > 1 ? argv[1] : "./abootimg", abootimg)) {
+    perror(argc > 1 ? argv[1] : "./abootimg");
+    return 1;
+  }
+  if (!mkdtemp(dir) || chdir(dir)) {
+    perror(dir);
+    return 1;
+  }
+
+  // a small image, so that the fixed cost of a command shows
+  if (write_random("k", 600 << 10) || write_random("r", 200 << 10)) {
+    perror("");
+    return 1;
+  }
+  char* create[] = { "abootimg", "--create", "boot.img", "-k", "k", "-r", "r", NULL };
+  if (run_in_process(7, create))
+    return 1;
+
+  printf("* %d runs on a 800 KB image\n", runs);
+  char* info[] = { "abootimg", "-i", "boot.img", NULL };
+  bench("-i", abootimg, runs, 3, info);
+  char* extract[] = { "abootimg", "-x", "boot.img", "cfg", "k.out", "r.out", NULL };
+  bench("-x", abootimg, runs, 6, extract);
+
+  unlink("boot.img"); unlink("k"); unlink("r");
+  unlink("cfg"); unlink("k.out"); unlink("r.out");
+  rmdir(dir);
+  return 0;
+}
@@ -0,0 +1,308 @@
+/* sha_bench - SHA-1 throughput on boot image sized buffers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../minicript/sha.h"
+#include "../minicript/sha256.h"
+#include "../minicript/sha_mb.h"
+
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * SHA_update as it was before blocks were hashed in place: every byte is
+ * copied to the context buffer, and the transform reads it from there.
+ * Kept here as the baseline the current code is measured against.
+ */
+typedef struct
+{
+  uint32_t     state[5];
+  uint64_t     count;
+  uint8_t      buf[64];
+} t_old_sha;
+
+#define rol(bits, value) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+static void old_transform(t_old_sha* ctx)
+{
+  uint32_t W[80];
+  uint32_t A, B, C, D, E;
+  uint8_t* p = ctx->buf;
+  int t;
+
+  for (t = 0; t < 16; ++t) {
+    uint32_t tmp = *p++ << 24;
+    tmp |= *p++ << 16;
+    tmp |= *p++ << 8;
+    tmp |= *p++;
+    W[t] = tmp;
+  }
+  for (; t < 80; t++)
+    W[t] = rol(1, W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
+
+  A = ctx->state[0];
+  B = ctx->state[1];
+  C = ctx->state[2];
+  D = ctx->state[3];
+  E = ctx->state[4];
+
+  for (t = 0; t < 80; t++) {
+    uint32_t tmp = rol(5, A) + E + W[t];
+
+    if (t < 20)
+      tmp += (D^(B&(C^D))) + 0x5A827999;
+    else if (t < 40)
+      tmp += (B^C^D) + 0x6ED9EBA1;
+    else if (t < 60)
+      tmp += ((B&C)|(D&(B|C))) + 0x8F1BBCDC;
+    else
+      tmp += (B^C^D) + 0xCA62C1D6;
+
+    E = D;
+    D = C;
+    C = rol(30, B);
+    B = A;
+    A = tmp;
+  }
+
+  ctx->state[0] += A;
+  ctx->state[1] += B;
+  ctx->state[2] += C;
+  ctx->state[3] += D;
+  ctx->state[4] += E;
+}
+
+static void old_update(t_old_sha* ctx, const void* data, int len)
+{
+  int i = (int)(ctx->count & 63);
+  const uint8_t* p = data;
+
+  ctx->count += len;
+  while (len--) {
+    ctx->buf[i++] = *p++;
+    if (i == 64) {
+      old_transform(ctx);
+      i = 0;
+    }
+  }
+}
+
+static void old_final(t_old_sha* ctx, uint8_t* digest)
+{
+  uint64_t cnt = ctx->count * 8;
+  int i;
+
+  old_update(ctx, "\x80", 1);
+  while ((ctx->count & 63) != 56)
+    old_update(ctx, "\0", 1);
+  for (i = 0; i < 8; ++i) {
+    uint8_t tmp = cnt >> ((7 - i) * 8);
+    old_update(ctx, &tmp, 1);
+  }
+  for (i = 0; i < 20; i++)
+    digest[i] = ctx->state[i / 4] >> (24 - 8 * (i % 4));
+}
+
+static double bench_old(const char* buf, int len, uint8_t* digest)
+{
+  static const uint32_t iv[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+  t_old_sha ctx;
+  double t0 = now();
+
+  memcpy(ctx.state, iv, sizeof(iv));
+  ctx.count = 0;
+  old_update(&ctx, buf, len);
+  old_final(&ctx, digest);
+
+  return now() - t0;
+}
+
+
+/*
+ * Hash len bytes of buf, feeding SHA_update chunk bytes at a time.
+ */
+static double bench_update(const char* buf, int len, int chunk, uint8_t* digest)
+{
+  SHA_CTX ctx;
+  double t0 = now();
+  int i;
+
+  SHA_init(&ctx);
+  for (i = 0; i < len; i += chunk)
+    SHA_update(&ctx, buf + i, (len - i < chunk) ? len - i : chunk);
+  memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+
+  return now() - t0;
+}
+
+
+/*
+ * Aggregate throughput over many small images, each made of a kernel,
+ * its size, a ramdisk and its size like the boot image id: N calls to
+ * the single-buffer path vs the multi-buffer engine.
+ */
+static void bench_mb(void)
+{
+  enum { NJOBS = 1024, KSIZE = 96 << 10, RSIZE = 33 << 10 };
+  SHA_MB_JOB* jobs = calloc(NJOBS, sizeof(*jobs));
+  SHA_MB_SEG* segs = calloc(NJOBS * 4, sizeof(*segs));
+  uint8_t (*ref)[SHA_DIGEST_SIZE] = calloc(NJOBS, SHA_DIGEST_SIZE);
+  static const unsigned ksize = KSIZE, rsize = RSIZE;
+  char* data = malloc(NJOBS + KSIZE + RSIZE);
+  const char* saved = SHA_mb_backend();
+  const char* names[] = { "serial", "sse2", "avx2" };
+  double total = (double)NJOBS * (KSIZE + RSIZE + 8);
+  unsigned i, n;
+  int b;
+
+  if (!jobs || !segs || !ref || !data) {
+    perror("malloc");
+    exit(1);
+  }
+  for (i = 0; i < NJOBS + KSIZE + RSIZE; i++)
+    data[i] = rand();
+
+  for (i = 0; i < NJOBS; i++) {
+    // every job starts at a different offset so the digests differ
+    segs[4*i+0].data = data + i;
+    segs[4*i+0].len = KSIZE;
+    segs[4*i+1].data = &ksize;
+    segs[4*i+1].len = sizeof(ksize);
+    segs[4*i+2].data = data + i + KSIZE;
+    segs[4*i+2].len = RSIZE;
+    segs[4*i+3].data = &rsize;
+    segs[4*i+3].len = sizeof(rsize);
+    jobs[i].segs = &segs[4*i];
+    jobs[i].nsegs = 4;
+  }
+
+  printf("* %d images of %d KB\n", NJOBS, (KSIZE + RSIZE) >> 10);
+
+  for (b = 0; (names[0] = SHA_backend_list(b)); b++) {
+    const char* best = SHA_backend();
+    SHA_set_backend(names[0]);
+    double t0 = now();
+    for (i = 0; i < NJOBS; i++) {
+      SHA_CTX ctx;
+      SHA_init(&ctx);
+      for (n = 0; n < 4; n++)
+        SHA_update(&ctx, segs[4*i+n].data, segs[4*i+n].len);
+      memcpy(ref[i], SHA_final(&ctx), SHA_DIGEST_SIZE);
+    }
+    double t = now() - t0;
+    printf("  %d x SHA_update %-6s %8.1f MB/s\n", NJOBS, names[0], total / t / 1e6);
+    SHA_set_backend(best);
+  }
+
+  names[0] = "serial";
+  for (b = 0; b < 3; b++) {
+    if (SHA_mb_set_backend(names[b]))
+      continue;
+    double t0 = now();
+    SHA_mb_hash(jobs, NJOBS);
+    double t = now() - t0;
+    int bad = 0;
+    for (i = 0; i < NJOBS; i++)
+      bad |= memcmp(ref[i], jobs[i].digest, SHA_DIGEST_SIZE) != 0;
+    printf("  multi-buffer %-6s x%d %8.1f MB/s%s\n", names[b], SHA_mb_lanes(),
+           total / t / 1e6, bad ? "  digest mismatch!" : "");
+  }
+  SHA_mb_set_backend(saved);
+
+  free(jobs);
+  free(segs);
+  free(ref);
+  free(data);
+}
+
+
+int main(void)
+{
+  static const int sizes[] = { 32 << 20, 64 << 20 };
+  static const int chunks[] = { 1, 61, 4096, 1 << 30 };
+  const char* name;
+  unsigned s, c, i;
+  int b;
+
+  printf("* self-test: sha1 %s, sha256 %s\n", SHA_selftest() ? "FAILED" : "ok",
+         SHA256_selftest() ? "FAILED" : "ok");
+  printf("* default backends: sha1 %s, sha256 %s\n", SHA_backend(), SHA256_backend());
+
+  for (s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+    int len = sizes[s];
+    // one spare byte to exercise the unaligned path
+    char* buf = malloc(len + 1);
+    uint8_t ref[SHA_DIGEST_SIZE];
+    uint8_t digest[SHA_DIGEST_SIZE];
+
+    if (!buf) {
+      perror("malloc");
+      return 1;
+    }
+    srand(len);
+    for (i = 0; i < (unsigned)len + 1; i++)
+      buf[i] = rand();
+
+    printf("* %d MB buffer\n", len >> 20);
+    for (c = 0; c < sizeof(chunks)/sizeof(chunks[0]); c++) {
+      double t = bench_update(buf, len, chunks[c], digest);
+      if (c == 0)
+        memcpy(ref, digest, sizeof(ref));
+      else if (memcmp(ref, digest, sizeof(ref)))
+        printf("  digest mismatch!\n");
+      if (chunks[c] >= len)
+        printf("  whole buffer          %8.1f MB/s\n", len / t / 1e6);
+      else if (chunks[c] == 1)
+        printf("  1-byte update calls   %8.1f MB/s\n", len / t / 1e6);
+      else
+        printf("  %5d byte updates    %8.1f MB/s\n", chunks[c], len / t / 1e6);
+    }
+    double t = bench_old(buf, len, digest);
+    printf("  baseline (byte copy)  %8.1f MB/s%s\n", len / t / 1e6,
+           memcmp(ref, digest, sizeof(ref)) ? "  digest mismatch!" : "");
+    t = bench_update(buf + 1, len, len, digest);
+    printf("  unaligned buffer      %8.1f MB/s\n", len / t / 1e6);
+
+    const char* best = SHA_backend();
+    for (b = 0; (name = SHA_backend_list(b)); b++) {
+      SHA_set_backend(name);
+      t = bench_update(buf, len, len, digest);
+      printf("  backend %-12s  %8.1f MB/s%s\n", name, len / t / 1e6,
+             memcmp(ref, digest, sizeof(ref)) ? "  digest mismatch!" : "");
+    }
+    SHA_set_backend(best);
+
+    best = SHA256_backend();
+    for (b = 0; (name = SHA256_backend_list(b)); b++) {
+      SHA256_CTX ctx;
+      SHA256_set_backend(name);
+      double t0 = now();
+      SHA256_init(&ctx);
+      SHA256_update(&ctx, buf, len);
+      SHA256_final(&ctx);
+      t = now() - t0;
+      printf("  sha256 %-12s   %8.1f MB/s\n", name, len / t / 1e6);
+    }
+    SHA256_set_backend(best);
+
+    free(buf);
+  }
+
+  bench_mb();
+
+  return 0;
+}
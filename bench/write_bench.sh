@@ -0,0 +1,51 @@
+#!/bin/sh
+# write_bench - buffered vs O_DIRECT image writes
+#
+# usage: bench/write_bench.sh [<target> [<runs>]]
+#
+# target defaults to a scratch file, used as a stand-in for a block
+# device (a loop device over a file works as well). ALL DATA ON THE TARGET
+# IS OVERWRITTEN.
+
+set -e
+
+ABOOTIMG=${ABOOTIMG:-./abootimg}
+TARGET=${1:-}
+RUNS=${2:-5}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+[ -n "$TARGET" ] || TARGET=$TMP/boot.img
+
+head -c 12000000 /dev/urandom > "$TMP/kernel"
+head -c 6000000 /dev/urandom > "$TMP/ramdisk"
+head -c 300000 /dev/urandom > "$TMP/devtree"
+
+if [ -b "$TARGET" ]; then
+  size=
+else
+  size="-c bootsize=0x2000000"
+fi
+
+run() {
+  mode=$1
+  shift
+  best=
+  for i in $(seq "$RUNS"); do
+    [ -b "$TARGET" ] || rm -f "$TARGET"
+    t0=$(date +%s%N)
+    out=$("$ABOOTIMG" --create "$TARGET" $size -k "$TMP/kernel" -r "$TMP/ramdisk" -t "$TMP/devtree" "$@" 2>/dev/null)
+    sync
+    t1=$(date +%s%N)
+    ms=$(( (t1 - t0) / 1000000 ))
+    if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+      best=$ms
+    fi
+  done
+  calls=$(echo "$out" | sed -n 's/.* in \([0-9]*\) write calls.*/\1/p')
+  printf "%-10s %6d ms (best of %d, write + sync), %s write calls\n" "$mode" "$best" "$RUNS" "$calls"
+}
+
+echo "target: $TARGET"
+run buffered --buffered
+run O_DIRECT --direct
@@ -0,0 +1,1008 @@
+/* compress.c - ramdisk compression formats, detected from their magic
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#ifdef HAS_LZMA
+#include <lzma.h>
+#endif
+
+#ifdef HAS_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+
+
+static uint32_t get_le32(const unsigned char* p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static const char* names[nformats] = { "none", "gzip", "lz4", "xz", "lzma", "zstd" };
+
+int fmt_detect(const void* buf, size_t len)
+{
+  const unsigned char* b = buf;
+
+  if ((len >= 2) && (b[0] == 0x1f) && ((b[1] == 0x8b) || (b[1] == 0x9e)))
+    return fmt_gzip;
+  if ((len >= 4) && !memcmp(b, "\x02\x21\x4c\x18", 4))
+    return fmt_lz4;
+  if ((len >= 6) && !memcmp(b, "\xfd" "7zXZ\0", 6))
+    return fmt_xz;
+  if ((len >= 4) && !memcmp(b, "\x28\xb5\x2f\xfd", 4))
+    return fmt_zstd;
+  if ((len >= 6) && (!memcmp(b, "070701", 6) || !memcmp(b, "070702", 6)))
+    return fmt_none;
+  // lzma_alone: properties (lc + lp * 9 + pb * 45), a dictionary size of
+  // 2^n or 2^n + 2^(n-1), and the uncompressed size, -1 if unknown
+  if ((len >= 13) && (b[0] < 9 * 5 * 5)) {
+    uint32_t dict = get_le32(b + 1);
+    uint32_t low = dict & -dict;
+    if ((dict >= 4096) && ((dict == low) || (dict == 3 * low)) &&
+        (!memcmp(b + 5, "\xff\xff\xff\xff\xff\xff\xff\xff", 8) || (!b[11] && !b[12])))
+      return fmt_lzma;
+  }
+  return -1;
+}
+
+const char* fmt_name(int fmt)
+{
+  return (fmt >= 0) && (fmt < nformats) ? names[fmt] : "unknown";
+}
+
+int fmt_by_name(const char* name)
+{
+  int i;
+
+  for (i = 0; i < nformats; i++)
+    if (!strcmp(name, names[i]))
+      return i;
+  return -1;
+}
+
+int fmt_supported(int fmt)
+{
+  switch (fmt) {
+    case fmt_none:
+    case fmt_gzip:
+    case fmt_lz4:
+      return 1;
+#ifdef HAS_LZMA
+    case fmt_xz:
+    case fmt_lzma:
+      return 1;
+#endif
+#ifdef HAS_ZSTD
+    case fmt_zstd:
+      return 1;
+#endif
+    default:
+      return 0;
+  }
+}
+
+
+static int bad_data(t_codec* c, const char* error)
+{
+  c->error = error;
+  errno = EINVAL;
+  return -1;
+}
+
+static size_t copy_out(t_codec* c, const char* data, size_t len)
+{
+  size_t n = len < c->avail_out ? len : c->avail_out;
+
+  memcpy(c->next_out, data, n);
+  c->next_out += n;
+  c->avail_out -= n;
+  return n;
+}
+
+/* uncompressed data goes through */
+static int none_run(t_codec* c, int finish)
+{
+  size_t n = copy_out(c, c->next_in, c->avail_in);
+
+  c->next_in += n;
+  c->avail_in -= n;
+  return finish && !c->avail_in;
+}
+
+
+/*
+ * gzip: zlib with the gzip wrapper. Decoding goes on through concatenated
+ * members and skips zeroes after them, as the kernel does.
+ */
+typedef struct
+{
+  z_stream     z;
+  int          end;       /* of a member */
+} t_gzip;
+
+static int gzip_init(t_codec* c, int level)
+{
+  t_gzip* g = calloc(1, sizeof(t_gzip));
+  int ret;
+
+  if (!g)
+    return -1;
+  if (c->encode)
+    ret = deflateInit2(&g->z, level ? level : 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+  else
+    ret = inflateInit2(&g->z, 15 + 32);
+  if (ret != Z_OK) {
+    free(g);
+    errno = ENOMEM;
+    return -1;
+  }
+  c->state = g;
+  return 0;
+}
+
+static int gzip_run(t_codec* c, int finish)
+{
+  t_gzip* g = c->state;
+  int ret;
+
+  for (;;) {
+    if (!c->encode && g->end) {
+      while (c->avail_in && !*c->next_in) {
+        c->next_in++;
+        c->avail_in--;
+      }
+      if (!c->avail_in)
+        return finish;
+      inflateReset(&g->z);
+      g->end = 0;
+    }
+
+    g->z.next_in = (Bytef*)c->next_in;
+    g->z.avail_in = c->avail_in;
+    g->z.next_out = (Bytef*)c->next_out;
+    g->z.avail_out = c->avail_out;
+    if (c->encode)
+      ret = deflate(&g->z, finish ? Z_FINISH : Z_NO_FLUSH);
+    else
+      ret = inflate(&g->z, Z_NO_FLUSH);
+    c->next_in = (const char*)g->z.next_in;
+    c->avail_in = g->z.avail_in;
+    c->next_out = (char*)g->z.next_out;
+    c->avail_out = g->z.avail_out;
+
+    if (ret == Z_MEM_ERROR) {
+      errno = ENOMEM;
+      return -1;
+    }
+    if (c->encode)
+      return ret == Z_STREAM_END;
+    if (ret == Z_STREAM_END)
+      g->end = 1;
+    else if ((ret != Z_OK) && (ret != Z_BUF_ERROR))
+      return bad_data(c, g->z.msg ? g->z.msg : "corrupted data");
+    else
+      return 0;
+  }
+}
+
+static void gzip_end(t_codec* c)
+{
+  t_gzip* g = c->state;
+
+  if (c->encode)
+    deflateEnd(&g->z);
+  else
+    inflateEnd(&g->z);
+}
+
+
+/*
+ * lz4 legacy frames: a magic number, then blocks of up to 8 MB, each one
+ * compressed on its own and preceded by its compressed size. The block
+ * codec is the LZ4 block format, implemented here (fast greedy parsing)
+ * rather than pulling in liblz4.
+ */
+#define LZ4_MAGIC       0x184c2102
+#define LZ4_BLOCK       (8 << 20)
+#define LZ4_BOUND(n)    ((n) + (n) / 255 + 16)
+#define LZ4_HASH_LOG    16
+#define MINMATCH        4
+#define LASTLITERALS    5     /* the last bytes of a block are literals */
+#define MFLIMIT         12    /* no match starts in the last bytes */
+
+static uint32_t read32(const unsigned char* p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static void put_le32(unsigned char* p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static unsigned char* lz4_length(unsigned char* op, size_t n)
+{
+  for (; n >= 255; n -= 255)
+    *op++ = 255;
+  *op++ = n;
+  return op;
+}
+
+/* one sequence: literals, then a match unless ml is 0 (end of block) */
+static unsigned char* lz4_sequence(unsigned char* op, const unsigned char* lit, size_t nlit,
+                                   size_t off, size_t ml)
+{
+  unsigned char* token = op++;
+
+  *token = (nlit >= 15 ? 15 : nlit) << 4;
+  if (nlit >= 15)
+    op = lz4_length(op, nlit - 15);
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (!ml)
+    return op;
+
+  *op++ = off;
+  *op++ = off >> 8;
+  ml -= MINMATCH;
+  *token |= ml >= 15 ? 15 : ml;
+  if (ml >= 15)
+    op = lz4_length(op, ml - 15);
+  return op;
+}
+
+/*
+ * Compresses len bytes of src to dst, which holds LZ4_BOUND(len) bytes.
+ * table holds 1 << LZ4_HASH_LOG entries. Returns the compressed size.
+ */
+static size_t lz4_compress_block(const unsigned char* src, size_t len, unsigned char* dst,
+                                 uint32_t* table)
+{
+  const unsigned char* ip = src;
+  const unsigned char* anchor = src;
+  const unsigned char* iend = src + len;
+  const unsigned char* matchlimit = iend - LASTLITERALS;
+  unsigned char* op = dst;
+
+  memset(table, 0, sizeof(uint32_t) << LZ4_HASH_LOG);
+
+  if (len > MFLIMIT) {
+    const unsigned char* mflimit = iend - MFLIMIT;
+
+    while (ip < mflimit) {
+      uint32_t seq = read32(ip);
+      uint32_t h = (seq * 2654435761u) >> (32 - LZ4_HASH_LOG);
+      const unsigned char* ref = src + table[h];
+
+      table[h] = ip - src;
+      if ((ref >= ip) || (ip - ref > 65535) || (read32(ref) != seq)) {
+        ip++;
+        continue;
+      }
+
+      while ((ip > anchor) && (ref > src) && (ip[-1] == ref[-1])) {
+        ip--;
+        ref--;
+      }
+      const unsigned char* p = ip + MINMATCH;
+      const unsigned char* r = ref + MINMATCH;
+      while ((p < matchlimit) && (*p == *r)) {
+        p++;
+        r++;
+      }
+
+      op = lz4_sequence(op, anchor, ip - anchor, ip - ref, p - ip);
+      ip = anchor = p;
+    }
+  }
+
+  op = lz4_sequence(op, anchor, iend - anchor, 0, 0);
+  return op - dst;
+}
+
+/*
+ * Decompresses a block of len bytes to dst, of size bytes at most. Returns
+ * the decompressed size, or -1 for corrupted data.
+ */
+static long lz4_decompress_block(const unsigned char* src, size_t len, unsigned char* dst, size_t size)
+{
+  const unsigned char* ip = src;
+  const unsigned char* iend = src + len;
+  unsigned char* op = dst;
+  unsigned char* oend = dst + size;
+
+  for (;;) {
+    unsigned b;
+
+    if (ip >= iend)
+      return -1;
+    unsigned token = *ip++;
+
+    size_t nlit = token >> 4;
+    if (nlit == 15)
+      do {
+        if (ip >= iend)
+          return -1;
+        nlit += b = *ip++;
+      } while (b == 255);
+    if ((nlit > (size_t)(iend - ip)) || (nlit > (size_t)(oend - op)))
+      return -1;
+    memcpy(op, ip, nlit);
+    op += nlit;
+    ip += nlit;
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return -1;
+    size_t off = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (!off || (off > (size_t)(op - dst)))
+      return -1;
+
+    size_t ml = token & 15;
+    if (ml == 15)
+      do {
+        if (ip >= iend)
+          return -1;
+        ml += b = *ip++;
+      } while (b == 255);
+    ml += MINMATCH;
+    if (ml > (size_t)(oend - op))
+      return -1;
+
+    const unsigned char* m = op - off;
+    if (off >= ml)
+      memcpy(op, m, ml);
+    else {
+      // overlapping: the match repeats the last off bytes
+      size_t i;
+      for (i = 0; i < ml; i++)
+        op[i] = m[i];
+    }
+    op += ml;
+  }
+
+  return op - dst;
+}
+
+typedef struct
+{
+  unsigned char hdr[4];   /* magic or block size being read */
+  size_t       hdr_len;
+  int          started;   /* magic read or written */
+  int          done;      /* zero padding reached */
+  unsigned char* in;      /* block being gathered */
+  size_t       in_len;
+  size_t       in_size;   /* of the block, when decoding */
+  unsigned char* out;     /* block not handed out yet */
+  size_t       out_pos;
+  size_t       out_len;
+  uint32_t*    table;
+} t_lz4;
+
+static int lz4_init(t_codec* c)
+{
+  t_lz4* l = calloc(1, sizeof(t_lz4));
+
+  if (!l)
+    return -1;
+  c->state = l;
+  l->in = malloc(c->encode ? LZ4_BLOCK : LZ4_BOUND(LZ4_BLOCK));
+  l->out = malloc(c->encode ? 8 + LZ4_BOUND(LZ4_BLOCK) : LZ4_BLOCK);
+  if (c->encode)
+    l->table = malloc(sizeof(uint32_t) << LZ4_HASH_LOG);
+  if (!l->in || !l->out || (c->encode && !l->table)) {
+    free(l->in);
+    free(l->out);
+    free(l->table);
+    free(l);
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+/* gathers up to len bytes of input at dst, which holds *have already */
+static void gather(t_codec* c, unsigned char* dst, size_t* have, size_t len)
+{
+  size_t n = len - *have < c->avail_in ? len - *have : c->avail_in;
+
+  memcpy(dst + *have, c->next_in, n);
+  *have += n;
+  c->next_in += n;
+  c->avail_in -= n;
+}
+
+static void drain(t_codec* c, t_lz4* l)
+{
+  l->out_pos += copy_out(c, (char*)l->out + l->out_pos, l->out_len - l->out_pos);
+  if (l->out_pos == l->out_len)
+    l->out_pos = l->out_len = 0;
+}
+
+static int lz4_encode(t_codec* c, t_lz4* l, int finish)
+{
+  for (;;) {
+    drain(c, l);
+    if (l->out_len)
+      return 0;
+    if (l->done)
+      return 1;
+
+    gather(c, l->in, &l->in_len, LZ4_BLOCK);
+    if ((l->in_len < LZ4_BLOCK) && !(finish && !c->avail_in))
+      return 0;
+
+    if (!l->started) {
+      put_le32(l->out, LZ4_MAGIC);
+      l->out_len = 4;
+      l->started = 1;
+    }
+    if (l->in_len) {
+      size_t n = lz4_compress_block(l->in, l->in_len, l->out + l->out_len + 4, l->table);
+      put_le32(l->out + l->out_len, n);
+      l->out_len += 4 + n;
+      l->in_len = 0;
+    }
+    if (finish && !c->avail_in)
+      l->done = 1;
+  }
+}
+
+static int lz4_decode(t_codec* c, t_lz4* l, int finish)
+{
+  for (;;) {
+    drain(c, l);
+    if (l->out_len)
+      return 0;
+    if (l->done)
+      return 1;
+
+    if (l->in_size) {
+      gather(c, l->in, &l->in_len, l->in_size);
+      if (l->in_len < l->in_size)
+        return finish ? bad_data(c, "truncated lz4 block") : 0;
+      long n = lz4_decompress_block(l->in, l->in_len, l->out, LZ4_BLOCK);
+      if (n < 0)
+        return bad_data(c, "corrupted lz4 block");
+      l->out_len = n;
+      l->in_size = l->in_len = 0;
+      continue;
+    }
+
+    if (!l->hdr_len && !c->avail_in && finish && l->started)
+      return 1;
+    gather(c, l->hdr, &l->hdr_len, 4);
+    if (l->hdr_len < 4)
+      return finish ? bad_data(c, "truncated lz4 data") : 0;
+    uint32_t v = get_le32(l->hdr);
+    l->hdr_len = 0;
+
+    if (!l->started) {
+      if (v != LZ4_MAGIC)
+        return bad_data(c, "not lz4 legacy data");
+      l->started = 1;
+    }
+    else if (v == LZ4_MAGIC)
+      continue;   /* next frame */
+    else if (!v)
+      l->done = 1;  /* zero padding */
+    else if (v > LZ4_BOUND(LZ4_BLOCK))
+      return bad_data(c, "corrupted lz4 block size");
+    else
+      l->in_size = v;
+  }
+}
+
+static void lz4_end(t_codec* c)
+{
+  t_lz4* l = c->state;
+
+  free(l->in);
+  free(l->out);
+  free(l->table);
+}
+
+
+#ifdef HAS_LZMA
+/*
+ * xz and lzma: liblzma. xz streams are checked with CRC32, as the kernel
+ * does not know CRC64 nor SHA-256.
+ */
+static int lzma_init(t_codec* c, int level)
+{
+  lzma_stream init = LZMA_STREAM_INIT;
+  lzma_stream* s = malloc(sizeof(lzma_stream));
+  lzma_options_lzma opt;
+  lzma_ret ret;
+
+  if (!s)
+    return -1;
+  *s = init;
+  if (!level)
+    level = LZMA_PRESET_DEFAULT;
+
+  if (c->encode && (c->fmt == fmt_xz))
+    ret = lzma_easy_encoder(s, level, LZMA_CHECK_CRC32);
+  else if (c->encode) {
+    lzma_lzma_preset(&opt, level);
+    ret = lzma_alone_encoder(s, &opt);
+  }
+  else if (c->fmt == fmt_xz)
+    ret = lzma_stream_decoder(s, UINT64_MAX, LZMA_CONCATENATED);
+  else
+    ret = lzma_alone_decoder(s, UINT64_MAX);
+
+  if (ret != LZMA_OK) {
+    free(s);
+    errno = ret == LZMA_MEM_ERROR ? ENOMEM : EINVAL;
+    return -1;
+  }
+  c->state = s;
+  return 0;
+}
+
+static int lzma_run(t_codec* c, int finish)
+{
+  lzma_stream* s = c->state;
+
+  s->next_in = (const uint8_t*)c->next_in;
+  s->avail_in = c->avail_in;
+  s->next_out = (uint8_t*)c->next_out;
+  s->avail_out = c->avail_out;
+  lzma_ret ret = lzma_code(s, finish ? LZMA_FINISH : LZMA_RUN);
+  c->next_in = (const char*)s->next_in;
+  c->avail_in = s->avail_in;
+  c->next_out = (char*)s->next_out;
+  c->avail_out = s->avail_out;
+
+  switch (ret) {
+    case LZMA_OK:
+      return 0;
+    case LZMA_STREAM_END:
+      return 1;
+    case LZMA_BUF_ERROR:
+      return finish && c->avail_out ? bad_data(c, "truncated data") : 0;
+    case LZMA_MEM_ERROR:
+    case LZMA_MEMLIMIT_ERROR:
+      errno = ENOMEM;
+      return -1;
+    case LZMA_FORMAT_ERROR:
+      return bad_data(c, "not xz/lzma data");
+    case LZMA_OPTIONS_ERROR:
+      return bad_data(c, "unsupported xz/lzma options");
+    default:
+      return bad_data(c, "corrupted xz/lzma data");
+  }
+}
+
+static void lzma_end_stream(t_codec* c)
+{
+  lzma_end(c->state);
+}
+#endif
+
+
+#ifdef HAS_ZSTD
+typedef struct
+{
+  ZSTD_CCtx*   cctx;
+  ZSTD_DCtx*   dctx;
+  size_t       hint;      /* 0 once a frame is complete and flushed */
+} t_zstd;
+
+static int zstd_init(t_codec* c, int level)
+{
+  t_zstd* z = calloc(1, sizeof(t_zstd));
+
+  if (!z)
+    return -1;
+  if (c->encode) {
+    z->cctx = ZSTD_createCCtx();
+    if (z->cctx)
+      ZSTD_CCtx_setParameter(z->cctx, ZSTD_c_compressionLevel, level ? level : 19);
+  }
+  else
+    z->dctx = ZSTD_createDCtx();
+  z->hint = 1;
+  if (!z->cctx && !z->dctx) {
+    free(z);
+    errno = ENOMEM;
+    return -1;
+  }
+  c->state = z;
+  return 0;
+}
+
+static int zstd_run(t_codec* c, int finish)
+{
+  t_zstd* z = c->state;
+  ZSTD_inBuffer in = { c->next_in, c->avail_in, 0 };
+  ZSTD_outBuffer out = { c->next_out, c->avail_out, 0 };
+  size_t ret;
+
+  if (c->encode)
+    ret = ZSTD_compressStream2(z->cctx, &out, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+  else
+    ret = ZSTD_decompressStream(z->dctx, &out, &in);
+  c->next_in += in.pos;
+  c->avail_in -= in.pos;
+  c->next_out += out.pos;
+  c->avail_out -= out.pos;
+
+  if (ZSTD_isError(ret))
+    return bad_data(c, ZSTD_getErrorName(ret));
+  if (c->encode)
+    return finish && !ret;
+
+  // frames follow each other until the input ends; what a call without
+  // progress returns is about the next frame
+  if (in.pos || out.pos)
+    z->hint = ret;
+  if (finish && !c->avail_in && c->avail_out) {
+    if (z->hint)
+      return bad_data(c, "truncated zstd data");
+    return 1;
+  }
+  return 0;
+}
+
+static void zstd_end(t_codec* c)
+{
+  t_zstd* z = c->state;
+
+  ZSTD_freeCCtx(z->cctx);
+  ZSTD_freeDCtx(z->dctx);
+}
+#endif
+
+
+int codec_init(t_codec* c, int fmt, int encode, int level)
+{
+  int ret;
+
+  memset(c, 0, sizeof(*c));
+  c->fmt = fmt;
+  c->encode = encode;
+
+  switch (fmt) {
+    case fmt_none:
+      return 0;
+    case fmt_gzip:
+      ret = gzip_init(c, level);
+      break;
+    case fmt_lz4:
+      ret = lz4_init(c);
+      break;
+#ifdef HAS_LZMA
+    case fmt_xz:
+    case fmt_lzma:
+      ret = lzma_init(c, level);
+      break;
+#endif
+#ifdef HAS_ZSTD
+    case fmt_zstd:
+      ret = zstd_init(c, level);
+      break;
+#endif
+    default:
+      errno = ENOTSUP;
+      return -1;
+  }
+
+  if (ret && (errno != EINVAL))
+    errno = ENOMEM;
+  return ret;
+}
+
+int codec_run(t_codec* c, int finish)
+{
+  switch (c->fmt) {
+    case fmt_gzip:
+      return gzip_run(c, finish);
+    case fmt_lz4:
+      return c->encode ? lz4_encode(c, c->state, finish) : lz4_decode(c, c->state, finish);
+#ifdef HAS_LZMA
+    case fmt_xz:
+    case fmt_lzma:
+      return lzma_run(c, finish);
+#endif
+#ifdef HAS_ZSTD
+    case fmt_zstd:
+      return zstd_run(c, finish);
+#endif
+    default:
+      return none_run(c, finish);
+  }
+}
+
+void codec_end(t_codec* c)
+{
+  if (!c->state)
+    return;
+
+  switch (c->fmt) {
+    case fmt_gzip:
+      gzip_end(c);
+      break;
+    case fmt_lz4:
+      lz4_end(c);
+      break;
+#ifdef HAS_LZMA
+    case fmt_xz:
+    case fmt_lzma:
+      lzma_end_stream(c);
+      break;
+#endif
+#ifdef HAS_ZSTD
+    case fmt_zstd:
+      zstd_end(c);
+      break;
+#endif
+  }
+  free(c->state);
+  c->state = NULL;
+}
+
+
+
+/*
+ * Blocks. gzip: raw deflate streams primed with the 32 KB before them, the
+ * last one finished and the others ended by a sync flush, in a single gzip
+ * member (as pigz does). lz4: legacy frame blocks. xz: xz blocks, listed
+ * in the index after them (as xz -T does).
+ */
+#define GZIP_BLOCK      (128 << 10)
+#define GZIP_DICT       (32 << 10)    /* deflate window */
+#define LZ4_PAR_BLOCK   (1 << 20)     /* matches reach 64 KB back only */
+#define XZ_BLOCK        (4 << 20)
+
+int blocks_init(t_blocks* b, int fmt, int level)
+{
+  memset(b, 0, sizeof(*b));
+  b->fmt = fmt;
+
+  switch (fmt) {
+    case fmt_gzip:
+      b->level = level ? level : 9;
+      b->block_size = GZIP_BLOCK;
+      b->dict_size = GZIP_DICT;
+      b->bound = compressBound(GZIP_BLOCK) + 16;
+      b->crc = crc32(0, NULL, 0);
+      return 0;
+
+    case fmt_lz4:
+      b->block_size = LZ4_PAR_BLOCK;
+      b->bound = 4 + LZ4_BOUND(LZ4_PAR_BLOCK);
+      return 0;
+
+#ifdef HAS_LZMA
+    case fmt_xz:
+      b->level = level ? level : (int)LZMA_PRESET_DEFAULT;
+      b->block_size = XZ_BLOCK;
+      b->bound = lzma_block_buffer_bound(XZ_BLOCK);
+      b->index = lzma_index_init(NULL);
+      if (!b->index) {
+        errno = ENOMEM;
+        return -1;
+      }
+      return 0;
+#endif
+
+    default:
+      errno = ENOTSUP;
+      return -1;
+  }
+}
+
+size_t blocks_header(t_blocks* b, char* buf)
+{
+  unsigned char* h = (unsigned char*)buf;
+
+  switch (b->fmt) {
+    case fmt_gzip:
+      // as zlib writes it: no name, null time, Unix
+      memcpy(h, "\x1f\x8b\x08\0\0\0\0\0\0\x03", 10);
+      h[8] = b->level == 9 ? 2 : b->level == 1 ? 4 : 0;
+      return 10;
+
+    case fmt_lz4:
+      put_le32(h, LZ4_MAGIC);
+      return 4;
+
+#ifdef HAS_LZMA
+    case fmt_xz: {
+      lzma_stream_flags flags;
+      memset(&flags, 0, sizeof(flags));
+      flags.check = LZMA_CHECK_CRC32;
+      if (lzma_stream_header_encode(&flags, h) != LZMA_OK)
+        return 0;
+      return LZMA_STREAM_HEADER_SIZE;
+    }
+#endif
+  }
+  return 0;
+}
+
+static void gzip_block(const t_blocks* b, t_block* blk)
+{
+  z_stream z;
+  int ret;
+
+  blk->crc = crc32(0, (const Bytef*)blk->in, blk->len);
+
+  memset(&z, 0, sizeof(z));
+  if (deflateInit2(&z, b->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    blk->failed = 1;
+    return;
+  }
+  if (blk->dictlen)
+    deflateSetDictionary(&z, (const Bytef*)blk->in - blk->dictlen, blk->dictlen);
+
+  z.next_in = (Bytef*)blk->in;
+  z.avail_in = blk->len;
+  z.next_out = (Bytef*)blk->out;
+  z.avail_out = b->bound;
+
+  // a sync flush ends the block on a byte boundary, without the final bit
+  ret = deflate(&z, blk->last ? Z_FINISH : Z_SYNC_FLUSH);
+  if (blk->last)
+    blk->failed = ret != Z_STREAM_END;
+  else
+    blk->failed = (ret != Z_OK) || z.avail_in || !z.avail_out;
+  blk->size = b->bound - z.avail_out;
+  deflateEnd(&z);
+}
+
+static void lz4_block(t_block* blk)
+{
+  uint32_t* table = malloc(sizeof(uint32_t) << LZ4_HASH_LOG);
+
+  if (!table) {
+    blk->failed = 1;
+    return;
+  }
+  size_t n = lz4_compress_block((const unsigned char*)blk->in, blk->len,
+                                (unsigned char*)blk->out + 4, table);
+  put_le32((unsigned char*)blk->out, n);
+  blk->size = 4 + n;
+  free(table);
+}
+
+#ifdef HAS_LZMA
+static void xz_block(const t_blocks* b, t_block* blk)
+{
+  lzma_options_lzma opt;
+  lzma_filter filters[2];
+  lzma_block block;
+  size_t pos = 0;
+
+  if (lzma_lzma_preset(&opt, b->level)) {
+    blk->failed = 1;
+    return;
+  }
+  // a larger dictionary than the block would only take memory
+  if (opt.dict_size > b->block_size)
+    opt.dict_size = b->block_size;
+
+  filters[0].id = LZMA_FILTER_LZMA2;
+  filters[0].options = &opt;
+  filters[1].id = LZMA_VLI_UNKNOWN;
+  filters[1].options = NULL;
+
+  memset(&block, 0, sizeof(block));
+  block.version = 0;
+  block.check = LZMA_CHECK_CRC32;
+  block.filters = filters;
+
+  if (lzma_block_buffer_encode(&block, NULL, (const uint8_t*)blk->in, blk->len,
+                               (uint8_t*)blk->out, &pos, b->bound) != LZMA_OK) {
+    blk->failed = 1;
+    return;
+  }
+  blk->size = pos;
+  blk->unpadded = lzma_block_unpadded_size(&block);
+}
+#endif
+
+void block_compress(const t_blocks* b, t_block* blk)
+{
+  blk->failed = 0;
+  switch (b->fmt) {
+    case fmt_gzip:
+      gzip_block(b, blk);
+      break;
+    case fmt_lz4:
+      lz4_block(blk);
+      break;
+#ifdef HAS_LZMA
+    case fmt_xz:
+      xz_block(b, blk);
+      break;
+#endif
+    default:
+      blk->failed = 1;
+  }
+}
+
+int blocks_add(t_blocks* b, const t_block* blk)
+{
+  b->size += blk->len;
+  if (b->fmt == fmt_gzip)
+    b->crc = crc32_combine(b->crc, blk->crc, blk->len);
+#ifdef HAS_LZMA
+  if ((b->fmt == fmt_xz) && (lzma_index_append(b->index, NULL, blk->unpadded, blk->len) != LZMA_OK)) {
+    errno = ENOMEM;
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+char* blocks_trailer(t_blocks* b, size_t* len)
+{
+  char* buf;
+
+  switch (b->fmt) {
+    case fmt_gzip:
+      // CRC32 and size, little endian
+      if (!(buf = malloc(8)))
+        return NULL;
+      put_le32((unsigned char*)buf, b->crc);
+      put_le32((unsigned char*)buf + 4, b->size);
+      *len = 8;
+      return buf;
+
+#ifdef HAS_LZMA
+    case fmt_xz: {
+      lzma_stream_flags flags;
+      size_t isize = lzma_index_size(b->index);
+      size_t pos = 0;
+
+      if (!(buf = malloc(isize + LZMA_STREAM_HEADER_SIZE)))
+        return NULL;
+      memset(&flags, 0, sizeof(flags));
+      flags.check = LZMA_CHECK_CRC32;
+      flags.backward_size = isize;
+      if ((lzma_index_buffer_encode(b->index, (uint8_t*)buf, &pos, isize) != LZMA_OK) ||
+          (lzma_stream_footer_encode(&flags, (uint8_t*)buf + pos) != LZMA_OK)) {
+        free(buf);
+        errno = ENOMEM;
+        return NULL;
+      }
+      *len = pos + LZMA_STREAM_HEADER_SIZE;
+      return buf;
+    }
+#endif
+
+    default:
+      *len = 0;
+      return malloc(1);
+  }
+}
+
+void blocks_end(t_blocks* b)
+{
+#ifdef HAS_LZMA
+  if (b->index)
+    lzma_index_end(b->index, NULL);
+#endif
+  b->index = NULL;
+}
@@ -0,0 +1,134 @@
+/* compress.h - ramdisk compression formats, detected from their magic
+ *
+ * gzip (zlib), and lz4 legacy frames, the format of "lz4 -l" which the
+ * kernel unpacks, are always available. xz and lzma need HAS_LZMA
+ * (liblzma), zstd needs HAS_ZSTD (libzstd).
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <stddef.h>
+
+enum ramdisk_format {
+  fmt_none,       /* uncompressed */
+  fmt_gzip,
+  fmt_lz4,        /* lz4 legacy frames */
+  fmt_xz,         /* with CRC32 checks, as the kernel wants them */
+  fmt_lzma,       /* legacy .lzma (lzma_alone) */
+  fmt_zstd,
+  nformats
+};
+
+/*
+ * Format of the data starting with buf (16 bytes are enough), or -1.
+ * Uncompressed data is recognized when it is a cpio archive.
+ */
+int fmt_detect(const void* buf, size_t len);
+
+const char* fmt_name(int fmt);
+
+/* format for a name as fmt_name gives it, or -1 */
+int fmt_by_name(const char* name);
+
+/* whether the format was built in */
+int fmt_supported(int fmt);
+
+
+/*
+ * A stream being compressed or decompressed, used as a z_stream: the
+ * caller sets next_in/avail_in and next_out/avail_out, and codec_run
+ * moves them forward.
+ */
+typedef struct
+{
+  const char*  next_in;
+  size_t       avail_in;
+  char*        next_out;
+  size_t       avail_out;
+
+  const char*  error;     /* when codec_run fails */
+
+  int          fmt;
+  int          encode;
+  void*        state;
+} t_codec;
+
+/*
+ * level 0 is the default of the format. Returns -1 with errno set:
+ * ENOMEM, or ENOTSUP if the format was not built in.
+ */
+int codec_init(t_codec* c, int fmt, int encode, int level);
+
+/*
+ * Goes on until the output is full or the input is used up. finish tells
+ * that no input follows what next_in holds. Returns 1 once the end of the
+ * stream was output, 0 if more is to come, -1 on errors (errno being
+ * EINVAL for bad data, c->error telling what).
+ */
+int codec_run(t_codec* c, int finish);
+
+void codec_end(t_codec* c);
+
+
+/*
+ * gzip, lz4 and xz can be compressed in parallel: the data is cut in
+ * blocks of block_size bytes (the last one can be shorter), compressed on
+ * their own by block_compress, on any thread, and written in order between
+ * the header and the trailer of the stream. The output only depends on the
+ * data and the level, not on how the blocks were spread on threads.
+ */
+#define BLOCKS_HEADER_MAX 12
+
+typedef struct
+{
+  const char*  in;        /* preceded by dictlen bytes of the data */
+  size_t       len;
+  size_t       dictlen;
+  int          last;
+  char*        out;       /* bound bytes */
+  size_t       size;      /* compressed */
+  unsigned long crc;      /* gzip */
+  unsigned long long unpadded;  /* xz */
+  int          failed;
+} t_block;
+
+typedef struct
+{
+  int          fmt;
+  int          level;
+  size_t       block_size;
+  size_t       dict_size; /* data before a block it is primed with (gzip) */
+  size_t       bound;     /* compressed size of a block, at most */
+  unsigned long crc;
+  unsigned long long size;
+  void*        index;     /* xz */
+} t_blocks;
+
+/*
+ * level 0 is the default of the format. Returns -1 with errno set: ENOTSUP
+ * if the format cannot be compressed in blocks, or ENOMEM.
+ */
+int blocks_init(t_blocks* b, int fmt, int level);
+
+/* writes the header of the stream, BLOCKS_HEADER_MAX bytes at most, and
+ * returns its size */
+size_t blocks_header(t_blocks* b, char* buf);
+
+/* sets blk->out (size, failed...) from blk->in; thread safe */
+void block_compress(const t_blocks* b, t_block* blk);
+
+/* accounts for the next block of the stream; 0, or -1 (ENOMEM) */
+int blocks_add(t_blocks* b, const t_block* blk);
+
+/* trailer of the stream, *len bytes, to free; NULL if out of memory */
+char* blocks_trailer(t_blocks* b, size_t* len);
+
+void blocks_end(t_blocks* b);
+
+#endif // COMPRESS_H_
@@ -0,0 +1,643 @@
+/* daemon.c - abootimg commands served over a Unix socket
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE /* accept4, struct ucred */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/fsuid.h>
+#include <sys/syscall.h>
+
+#include "libabootimg.h"
+#include "threadpool.h"
+#include "daemon.h"
+
+
+/*
+ * A request is a single SOCK_SEQPACKET message: the header, then argc
+ * NUL terminated arguments, with the current directory, stdout and
+ * stderr of the client attached. The reply is the exit status, as an
+ * int32_t. A client which does not send its request or take the reply
+ * within REQUEST_TIMEOUT seconds is dropped, rather than holding a worker.
+ */
+#define REQUEST_MAGIC   "ABD1"
+#define REQUEST_MAX     65536
+#define REQUEST_TIMEOUT 10
+
+typedef struct
+{
+  char         magic[4];
+  uint32_t     argc;
+} t_request_hdr;
+
+enum { fd_cwd, fd_out, fd_err, nfds };
+
+/*
+ * A daemon run as root serves any client that can reach the socket, with
+ * the credentials of the client, taken from the socket: requests run with
+ * its file system ids and groups. Any other daemon only serves its own
+ * user.
+ */
+typedef struct
+{
+  uid_t        uid;
+  gid_t        gid;
+  int          ngroups;
+  gid_t        groups[NGROUPS_MAX];
+} t_creds;
+
+typedef struct
+{
+  int          fd[nfds];
+  t_creds      creds;
+  int          argc;
+  char*        argv[REQUEST_MAX / 2];
+  char         buf[REQUEST_MAX];
+} t_request;
+
+
+/*
+ * Latencies are counted in buckets of a quarter of a power of 2 of
+ * microseconds, precise to 25% whatever the latency.
+ */
+#define LAT_BUCKETS     128
+
+typedef struct
+{
+  int          fd;
+  int          root;
+  t_creds      creds;     /* of the daemon */
+  pthread_mutex_t lock;
+  unsigned long long requests;
+  unsigned long long failed;
+  unsigned long long bytes_read;
+  unsigned long long bytes_written;
+  int          active;
+  unsigned long long lat[LAT_BUCKETS];
+  unsigned long long lat_max;   /* us */
+} t_daemon;
+
+
+static int lat_bucket(unsigned long long us)
+{
+  if (us < 4)
+    return us;
+  int msb = 63 - __builtin_clzll(us);
+  int b = 4 * (msb - 1) + ((us >> (msb - 2)) & 3);
+  return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+/* upper bound of a bucket, in us */
+static unsigned long long lat_bound(int b)
+{
+  if (b < 4)
+    return b + 1;
+  return (unsigned long long)(4 + (b & 3) + 1) << (b / 4 - 1);
+}
+
+static unsigned long long percentile(t_daemon* d, double p)
+{
+  unsigned long long total = 0, seen = 0;
+  int b;
+
+  for (b = 0; b < LAT_BUCKETS; b++)
+    total += d->lat[b];
+  for (b = 0; b < LAT_BUCKETS; b++) {
+    seen += d->lat[b];
+    if (seen && (seen >= p * total))
+      return lat_bound(b) < d->lat_max ? lat_bound(b) : d->lat_max;
+  }
+  return 0;
+}
+
+static void print_stats(t_daemon* d, FILE* f)
+{
+  pthread_mutex_lock(&d->lock);
+  fprintf(f, "requests       %llu\n", d->requests);
+  fprintf(f, "failed         %llu\n", d->failed);
+  fprintf(f, "active         %d\n", d->active);
+  fprintf(f, "bytes read     %llu\n", d->bytes_read);
+  fprintf(f, "bytes written  %llu\n", d->bytes_written);
+  fprintf(f, "latency (us)   p50 %llu  p90 %llu  p99 %llu  max %llu\n",
+          percentile(d, 0.50), percentile(d, 0.90), percentile(d, 0.99), d->lat_max);
+  pthread_mutex_unlock(&d->lock);
+}
+
+
+static void write_all(int fd, const char* data, size_t len)
+{
+  while (len) {
+    ssize_t wb = write(fd, data, len);
+    if (wb < 0) {
+      if (errno == EINTR)
+        continue;
+      return;  /* the client went away */
+    }
+    data += wb;
+    len -= wb;
+  }
+}
+
+static void log_to_client(void* ctx, int level, const char* msg)
+{
+  t_request* r = ctx;
+  write_all(r->fd[level == log_info ? fd_out : fd_err], msg, strlen(msg));
+}
+
+/*
+ * Files are opened in the directory of the client, and under it: absolute
+ * names and ".." are refused.
+ */
+static int open_at_client(void* ctx, const char* fname, int flags, mode_t mode)
+{
+  t_request* r = ctx;
+  const char* c;
+
+  if (fname[0] == '/') {
+    errno = EACCES;
+    return -1;
+  }
+  for (c = fname; c; c = strchr(c, '/')) {
+    if (*c == '/')
+      c++;
+    if ((c[0] == '.') && (c[1] == '.') && (!c[2] || (c[2] == '/'))) {
+      errno = EACCES;
+      return -1;
+    }
+  }
+  return openat(r->fd[fd_cwd], fname, flags | O_CLOEXEC, mode);
+}
+
+
+/*
+ * Switches the file system credentials of the calling thread, and so of
+ * the threads it starts. The setgroups system call is made directly: the
+ * libc one changes the groups of every thread.
+ */
+static int become(const t_creds* cr)
+{
+  if (syscall(SYS_setgroups, (size_t)cr->ngroups, cr->groups))
+    return -1;
+  setfsgid(cr->gid);
+  setfsuid(cr->uid);
+  if ((setfsgid(-1) != (int)cr->gid) || (setfsuid(-1) != (int)cr->uid)) {
+    errno = EPERM;
+    return -1;
+  }
+  return 0;
+}
+
+static int peer_creds(int c, t_creds* cr)
+{
+  struct ucred uc;
+  socklen_t len = sizeof(uc);
+
+  if (getsockopt(c, SOL_SOCKET, SO_PEERCRED, &uc, &len))
+    return -1;
+  cr->uid = uc.uid;
+  cr->gid = uc.gid;
+  cr->ngroups = 0;
+#ifdef SO_PEERGROUPS
+  // without them, the request runs with no supplementary groups
+  len = sizeof(cr->groups);
+  if (!getsockopt(c, SOL_SOCKET, SO_PEERGROUPS, cr->groups, &len))
+    cr->ngroups = len / sizeof(gid_t);
+#endif
+  return 0;
+}
+
+/*
+ * Takes on the credentials of the client of a request. Returns -1 if the
+ * request is not to be served.
+ */
+static int admit(t_daemon* d, int c, t_request* r)
+{
+  if (peer_creds(c, &r->creds))
+    return -1;
+  if (!d->root)
+    return r->creds.uid == d->creds.uid ? 0 : -1;
+  if (become(&r->creds)) {
+    if (become(&d->creds))
+      abort();
+    return -1;
+  }
+  return 0;
+}
+
+
+static void close_fds(t_request* r)
+{
+  int i;
+
+  for (i = 0; i < nfds; i++)
+    if (r->fd[i] != -1) {
+      close(r->fd[i]);
+      r->fd[i] = -1;
+    }
+}
+
+/*
+ * Takes the descriptors of the request from the control messages. Any
+ * other descriptor received is closed.
+ */
+static void take_fds(t_request* r, struct msghdr* msg)
+{
+  struct cmsghdr* cm;
+  int i;
+
+  for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+    if ((cm->cmsg_level != SOL_SOCKET) || (cm->cmsg_type != SCM_RIGHTS))
+      continue;
+    int n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (n <= 0)
+      continue;
+    int fd[n];
+    memcpy(fd, CMSG_DATA(cm), n * sizeof(int));
+    if ((n == nfds) && (r->fd[fd_cwd] == -1)) {
+      memcpy(r->fd, fd, sizeof(r->fd));
+      continue;
+    }
+    for (i = 0; i < n; i++)
+      close(fd[i]);
+  }
+}
+
+/*
+ * Reads a request. Returns -1 if it is not valid, the descriptors it
+ * came with being closed, errno being EAGAIN if it did not come in time.
+ */
+static int read_request(int c, t_request* r)
+{
+  union {
+    struct cmsghdr hdr;
+    char         buf[CMSG_SPACE(nfds * sizeof(int))];
+  } ctl;
+  struct iovec iov = { r->buf, sizeof(r->buf) - 1 };
+  struct msghdr msg;
+  t_request_hdr hdr;
+  int i;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+
+  ssize_t n = recvmsg(c, &msg, MSG_CMSG_CLOEXEC);
+  if (n < 0)
+    return -1;
+  take_fds(r, &msg);
+
+  if ((r->fd[fd_cwd] == -1) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+      (n < sizeof(hdr)))
+    goto bad;
+  memcpy(&hdr, r->buf, sizeof(hdr));
+  if (memcmp(hdr.magic, REQUEST_MAGIC, sizeof(hdr.magic)) ||
+      (hdr.argc < 1) || (hdr.argc >= sizeof(r->argv) / sizeof(r->argv[0])))
+    goto bad;
+
+  // arguments, each one NUL terminated
+  char* p = r->buf + sizeof(hdr);
+  char* end = r->buf + n;
+  *end = 0;
+  for (i = 0; i < hdr.argc; i++) {
+    if (p >= end)
+      goto bad;
+    r->argv[i] = p;
+    p += strlen(p) + 1;
+  }
+  r->argv[i] = NULL;
+  r->argc = hdr.argc;
+  return 0;
+
+bad:
+  close_fds(r);
+  errno = EPROTO;
+  return -1;
+}
+
+/*
+ * Runs the command of a request, as abootimg would. Returns its exit
+ * status.
+ */
+static int run_request(t_daemon* d, t_request* r)
+{
+  t_abootimg_io io = { open_at_client, log_to_client, r };
+  t_abootimg_stats stats;
+  char msg[300];
+  int status;
+
+  if ((r->argc == 2) && !strcmp(r->argv[1], "--stats")) {
+    FILE* f = fdopen(dup(r->fd[fd_out]), "w");
+    if (!f)
+      return 1;
+    print_stats(d, f);
+    fclose(f);
+    return 0;
+  }
+
+  t_abootimg* img = abootimg_new(&io);
+  if (!img)
+    return 1;
+
+  int cmd = abootimg_parse_args(img, r->argc, r->argv);
+  int ret = cmd;
+  if ((cmd == cmd_none) || (cmd == cmd_help))
+    ret = abootimg_einval;
+  else if (cmd >= 0)
+    ret = abootimg_run(img, cmd);
+
+  if ((cmd == cmd_none) || (cmd == cmd_help))
+    snprintf(msg, sizeof(msg), "error - bad arguments\n");
+  else if ((ret == abootimg_esys) || (ret == abootimg_einval))
+    snprintf(msg, sizeof(msg), "%s\n", abootimg_strerror(img));
+  else
+    msg[0] = 0;
+  write_all(r->fd[fd_err], msg, strlen(msg));
+
+  status = (ret == abootimg_esys) ? abootimg_errno(img) : (ret ? 1 : 0);
+
+  abootimg_get_stats(img, &stats);
+  pthread_mutex_lock(&d->lock);
+  d->bytes_read += stats.bytes_read;
+  d->bytes_written += stats.bytes_written;
+  pthread_mutex_unlock(&d->lock);
+
+  abootimg_free(img);
+  return status;
+}
+
+static void serve(t_daemon* d, int c)
+{
+  t_request* r = malloc(sizeof(*r));
+  struct timespec t0, t1;
+  int32_t status = 1;
+  int i;
+
+  if (!r)
+    return;
+  for (i = 0; i < nfds; i++)
+    r->fd[i] = -1;
+
+  if (read_request(c, r)) {
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+      free(r);
+      return;  /* dropped without a reply */
+    }
+  }
+  else if (admit(d, c, r)) {
+    static const char msg[] = "error - permission denied\n";
+    write_all(r->fd[fd_err], msg, sizeof(msg) - 1);
+    close_fds(r);
+  }
+  if (r->fd[fd_cwd] != -1) {
+    pthread_mutex_lock(&d->lock);
+    d->active++;
+    pthread_mutex_unlock(&d->lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    status = run_request(d, r);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    unsigned long long us = (t1.tv_sec - t0.tv_sec) * 1000000ULL + (t1.tv_nsec - t0.tv_nsec) / 1000;
+    pthread_mutex_lock(&d->lock);
+    d->active--;
+    d->requests++;
+    d->failed += !!status;
+    d->lat[lat_bucket(us)]++;
+    if (us > d->lat_max)
+      d->lat_max = us;
+    pthread_mutex_unlock(&d->lock);
+
+    // a worker left with the ids of a client would serve the next ones so
+    if (d->root && become(&d->creds))
+      abort();
+  }
+  send(c, &status, sizeof(status), MSG_NOSIGNAL);
+
+  close_fds(r);
+  free(r);
+}
+
+/*
+ * A worker: takes the next connection, until the listening socket is
+ * shut down.
+ */
+static void worker(void* arg, int i)
+{
+  t_daemon* d = arg;
+
+  for (;;) {
+    int c = accept4(d->fd, NULL, NULL, SOCK_CLOEXEC);
+    if (c == -1) {
+      if ((errno == EINTR) || (errno == ECONNABORTED))
+        continue;
+      if ((errno == EMFILE) || (errno == ENFILE) || (errno == ENOMEM)) {
+        usleep(10000);
+        continue;
+      }
+      return;
+    }
+    struct timeval tv = { REQUEST_TIMEOUT, 0 };
+    if (!setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) &&
+        !setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)))
+      serve(d, c);
+    close(c);
+  }
+}
+
+static void* wait_for_stop(void* arg)
+{
+  t_daemon* d = arg;
+  sigset_t set;
+  int sig;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTERM);
+  sigwait(&set, &sig);
+
+  // running requests are completed, the workers return from accept
+  shutdown(d->fd, SHUT_RDWR);
+  return NULL;
+}
+
+
+int run_daemon(const char* path, int nthreads)
+{
+  struct sockaddr_un addr;
+  pthread_t stop;
+  sigset_t set;
+  t_daemon d;
+
+  memset(&d, 0, sizeof(d));
+  pthread_mutex_init(&d.lock, NULL);
+  d.root = !geteuid();
+  d.creds.uid = geteuid();
+  d.creds.gid = getegid();
+  d.creds.ngroups = getgroups(NGROUPS_MAX, d.creds.groups);
+  if (d.creds.ngroups < 0) {
+    perror("getgroups");
+    return 1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+
+  d.fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (d.fd == -1) {
+    perror("socket");
+    return 1;
+  }
+
+  // a socket left by a daemon which is gone is replaced, a live one is not
+  if (!connect(d.fd, (struct sockaddr*)&addr, sizeof(addr))) {
+    fprintf(stderr, "%s: a daemon is already listening\n", path);
+    return 1;
+  }
+  if (errno == ECONNREFUSED)
+    unlink(path);
+
+  // only reachable by the user of the daemon, unless opened up later
+  mode_t mask = umask(0177);
+  int ret = bind(d.fd, (struct sockaddr*)&addr, sizeof(addr));
+  umask(mask);
+  if (ret || listen(d.fd, SOMAXCONN)) {
+    perror(path);
+    return 1;
+  }
+
+  // SIGINT and SIGTERM are only taken by wait_for_stop
+  signal(SIGPIPE, SIG_IGN);
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  if (pthread_create(&stop, NULL, wait_for_stop, &d)) {
+    perror("");
+    unlink(path);
+    return 1;
+  }
+
+  if (nthreads <= 0)
+    nthreads = tp_default_threads();
+  printf("abootimg daemon listening on %s, %d workers\n", path, nthreads);
+  fflush(stdout);
+
+  tp_run(worker, &d, nthreads, nthreads);
+
+  pthread_join(stop, NULL);
+  unlink(path);
+  close(d.fd);
+  print_stats(&d, stdout);
+  pthread_mutex_destroy(&d.lock);
+  return 0;
+}
+
+
+
+int run_client(const char* path, int argc, char** argv)
+{
+  union {
+    struct cmsghdr hdr;
+    char         buf[CMSG_SPACE(nfds * sizeof(int))];
+  } ctl;
+  struct sockaddr_un addr;
+  struct msghdr msg;
+  struct iovec iov;
+  t_request_hdr hdr;
+  int fd[nfds];
+  int32_t status;
+  size_t len;
+  int i;
+
+  memcpy(hdr.magic, REQUEST_MAGIC, sizeof(hdr.magic));
+  hdr.argc = argc;
+  len = sizeof(hdr);
+  for (i = 0; i < argc; i++)
+    len += strlen(argv[i]) + 1;
+  if (len >= REQUEST_MAX) {
+    fprintf(stderr, "%s: too many arguments\n", path);
+    return 1;
+  }
+
+  char* buf = malloc(len);
+  if (!buf) {
+    perror("");
+    return 1;
+  }
+  memcpy(buf, &hdr, sizeof(hdr));
+  len = sizeof(hdr);
+  for (i = 0; i < argc; i++) {
+    strcpy(buf + len, argv[i]);
+    len += strlen(argv[i]) + 1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if ((s == -1) || connect(s, (struct sockaddr*)&addr, sizeof(addr))) {
+    perror(path);
+    return 1;
+  }
+
+  fd[fd_cwd] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  fd[fd_out] = 1;
+  fd[fd_err] = 2;
+  if (fd[fd_cwd] == -1) {
+    perror(".");
+    return 1;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+  struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+  memcpy(CMSG_DATA(cm), fd, nfds * sizeof(int));
+
+  // stdout may be buffered by the caller, the daemon writes to it directly
+  fflush(stdout);
+
+  if ((sendmsg(s, &msg, MSG_NOSIGNAL) != len) ||
+      (recv(s, &status, sizeof(status), 0) != sizeof(status))) {
+    perror(path);
+    return 1;
+  }
+
+  close(fd[fd_cwd]);
+  close(s);
+  free(buf);
+  return status;
+}
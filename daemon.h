@@ -0,0 +1,32 @@
+/* daemon.h - abootimg commands served over a Unix socket
+ *
+ * A client sends the arguments of an abootimg command, along with its
+ * current directory, stdout and stderr (SCM_RIGHTS). The daemon opens the
+ * files named in the arguments under that directory, with the credentials
+ * of the client, prints on those stdout and stderr, and replies with the
+ * exit status.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+/*
+ * Serves requests on the socket at path with nthreads workers (0 for one
+ * per online CPU), until SIGINT or SIGTERM. Returns 1 if the socket could
+ * not be set up.
+ */
+int run_daemon(const char* path, int nthreads);
+
+/*
+ * Has the daemon listening at path run argv (argv[0] being ignored), or
+ * print its counters for "--stats". Returns the exit status of the
+ * command.
+ */
+int run_client(const char* path, int argc, char** argv);
+
+#endif // DAEMON_H_
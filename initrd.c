@@ -0,0 +1,1175 @@
+/* initrd.c - ramdisk archives: newc cpio, compressed
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+
+#include "initrd.h"
+#include "threadpool.h"
+#include "compress.h"
+
+
+/*
+ * The archive is gathered in batches, of about BATCH bytes per thread.
+ * gzip, lz4 and xz batches are cut in blocks (see compress.h) compressed
+ * on the thread pool once the batch is full; other formats go through a
+ * single stream, in blocks of BLOCK bytes.
+ */
+#define BATCH           (512 << 10)
+#define BLOCK           (128 << 10)
+
+#define NEWC_MAGIC      "070701"
+#define NEWC_TRAILER    "TRAILER!!!"
+
+/*
+ * A file with several names in the tree: they all get its number and its
+ * link count, and its content goes with the last one, as newc wants. The
+ * name met last is held back, since the others may be out of the tree:
+ * then it is packed with the content once the tree is done.
+ */
+typedef struct
+{
+  dev_t        dev;
+  ino_t        ino;
+  unsigned     cino;      /* number in the archive */
+  nlink_t      left;      /* names not met yet */
+  char*        held;      /* name met last, not packed yet */
+} t_link;
+
+typedef struct
+{
+  t_initrd*    rd;
+  int          fd;
+  int          threads;
+  int          parallel;  /* b, or else c */
+  t_blocks     b;
+  t_codec      c;
+  size_t       block_size;
+  size_t       dict;
+  int          nblocks;   /* per batch */
+  char*        buf;       /* end of the previous batch, then the batch */
+  char*        in;        /* buf + dict: archive bytes not compressed yet */
+  size_t       used;
+  size_t       cap;
+  int          started;   /* a batch was written, in[-dict] is valid */
+  t_block*     blocks;
+  char*        out;
+  size_t       outsize;   /* per block */
+  unsigned     ino;
+  int          root;      /* dirfd of the tree */
+  t_link*      links;
+  int          nlinks;
+} t_packer;
+
+
+void initrd_init(t_initrd* rd)
+{
+  memset(rd, 0, sizeof(*rd));
+  rd->format = fmt_gzip;
+}
+
+
+static int write_all(int fd, const char* data, size_t len)
+{
+  while (len) {
+    ssize_t wb = write(fd, data, len);
+    if (wb < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += wb;
+    len -= wb;
+  }
+  return 0;
+}
+
+/* tp_run task: compresses one block of the batch */
+static void compress_block(void* arg, int i)
+{
+  t_packer* p = arg;
+  block_compress(&p->b, &p->blocks[i]);
+}
+
+/*
+ * Formats not compressed in blocks: the batch goes through the streaming
+ * encoder.
+ */
+static int encode_batch(t_packer* p, int last)
+{
+  size_t size = (size_t)p->nblocks * p->outsize;
+  int ret;
+
+  p->c.next_in = p->in;
+  p->c.avail_in = p->used;
+  do {
+    p->c.next_out = p->out;
+    p->c.avail_out = size;
+    ret = codec_run(&p->c, last);
+    if (ret < 0)
+      return -1;
+    if (write_all(p->fd, p->out, size - p->c.avail_out))
+      return -1;
+    p->rd->size += size - p->c.avail_out;
+  } while (p->c.avail_in || !p->c.avail_out || (last && !ret));
+
+  p->used = 0;
+  return 0;
+}
+
+/*
+ * Compresses and writes the batch; last is set for the end of the
+ * archive.
+ */
+static int compress_batch(t_packer* p, int last)
+{
+  int n = (p->used + p->block_size - 1) / p->block_size;
+  int i;
+
+  if (!p->parallel)
+    return encode_batch(p, last);
+
+  for (i = 0; i < n; i++) {
+    t_block* b = &p->blocks[i];
+    size_t start = (size_t)i * p->block_size;
+
+    b->in = p->in + start;
+    b->len = p->used - start < p->block_size ? p->used - start : p->block_size;
+    b->dictlen = (i || p->started) ? p->dict : 0;
+    b->last = last && (i == n - 1);
+    b->out = p->out + i * p->outsize;
+  }
+
+  if (tp_run(compress_block, p, n, p->threads)) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  for (i = 0; i < n; i++) {
+    t_block* b = &p->blocks[i];
+    if (b->failed) {
+      errno = ENOMEM;   /* the encoders, the buffer is large enough */
+      return -1;
+    }
+    if (write_all(p->fd, b->out, b->size) || blocks_add(&p->b, b))
+      return -1;
+    p->rd->size += b->size;
+  }
+
+  // the end of the batch primes the first block of the next one
+  if (!last && p->dict)
+    memcpy(p->buf, p->in + p->used - p->dict, p->dict);
+  p->started = 1;
+  p->used = 0;
+  return 0;
+}
+
+static int emit(t_packer* p, const void* data, size_t len)
+{
+  const char* d = data;
+
+  while (len) {
+    if ((p->used == p->cap) && compress_batch(p, 0))
+      return -1;
+    size_t n = p->cap - p->used < len ? p->cap - p->used : len;
+    memcpy(p->in + p->used, d, n);
+    p->used += n;
+    p->rd->cpio_size += n;
+    d += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* newc aligns headers and contents to 4 bytes */
+static int pad(t_packer* p)
+{
+  static const char zero[4];
+  return emit(p, zero, -p->rd->cpio_size & 3);
+}
+
+static int emit_header(t_packer* p, const char* name, unsigned ino, unsigned mode,
+                       unsigned nlink, unsigned size, unsigned rmajor, unsigned rminor)
+{
+  char hdr[6 + 13 * 8 + 1];
+  unsigned namesize = strlen(name) + 1;
+
+  snprintf(hdr, sizeof(hdr), NEWC_MAGIC "%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+           ino, mode, 0, 0, nlink, 0, size, 0, 0, rmajor, rminor, namesize, 0);
+  if (emit(p, hdr, sizeof(hdr) - 1) || emit(p, name, namesize) || pad(p))
+    return -1;
+  return 0;
+}
+
+static int write_header(t_packer* p)
+{
+  char hdr[BLOCKS_HEADER_MAX];
+  size_t len = blocks_header(&p->b, hdr);
+
+  if (!len) {
+    errno = ENOMEM;
+    return -1;
+  }
+  if (write_all(p->fd, hdr, len))
+    return -1;
+  p->rd->size += len;
+  return 0;
+}
+
+static int write_trailer(t_packer* p)
+{
+  size_t len;
+  char* tr = blocks_trailer(&p->b, &len);
+  int ret;
+
+  if (!tr) {
+    errno = ENOMEM;
+    return -1;
+  }
+  ret = write_all(p->fd, tr, len);
+  if (!ret)
+    p->rd->size += len;
+  free(tr);
+  return ret;
+}
+
+
+static int by_name(const void* a, const void* b)
+{
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/*
+ * Names of a directory, stored one after the other.
+ */
+typedef struct
+{
+  char*        buf;
+  size_t       size;
+  size_t       used;
+  int          n;
+} t_names;
+
+static int add_name(t_names* l, const char* name)
+{
+  size_t len = strlen(name) + 1;
+
+  if (!strcmp(name, ".") || !strcmp(name, ".."))
+    return 0;
+  if (l->used + len > l->size) {
+    char* more = realloc(l->buf, l->size = 2 * l->size + len + 4096);
+    if (!more)
+      return -1;
+    l->buf = more;
+  }
+  memcpy(l->buf + l->used, name, len);
+  l->used += len;
+  l->n++;
+  return 0;
+}
+
+#ifdef SYS_getdents64
+struct dirent64_raw
+{
+  uint64_t     d_ino;
+  int64_t      d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char         d_name[];
+};
+#endif
+
+/*
+ * Names in the directory, sorted, "." and ".." left out. The names are
+ * stored after the array, which is freed at once.
+ */
+static char** list_dir(int dirfd, int* count)
+{
+  t_names l = { NULL, 0, 0, 0 };
+  int i;
+
+  if (lseek(dirfd, 0, SEEK_SET) == -1)
+    return NULL;
+
+#ifdef SYS_getdents64
+  char buf[32768];
+  long len, pos;
+
+  while ((len = syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0)
+    for (pos = 0; pos < len; pos += ((struct dirent64_raw*)(buf + pos))->d_reclen)
+      if (add_name(&l, ((struct dirent64_raw*)(buf + pos))->d_name))
+        goto fail;
+  if (len < 0)
+    goto fail;
+#else
+  DIR* dir = fdopendir(dup(dirfd));
+  struct dirent* d;
+
+  if (!dir)
+    goto fail;
+  errno = 0;
+  while ((d = readdir(dir)))
+    if (add_name(&l, d->d_name)) {
+      closedir(dir);
+      goto fail;
+    }
+  closedir(dir);
+  if (errno)
+    goto fail;
+#endif
+
+  char** list = malloc((l.n + 1) * sizeof(char*) + l.used);
+  if (!list)
+    goto fail;
+  char* p = (char*)(list + l.n + 1);
+  if (l.used)
+    memcpy(p, l.buf, l.used);
+  for (i = 0; i < l.n; i++) {
+    list[i] = p;
+    p += strlen(p) + 1;
+  }
+  list[l.n] = NULL;
+  free(l.buf);
+
+  qsort(list, l.n, sizeof(char*), by_name);
+  *count = l.n;
+  return list;
+
+fail:
+  free(l.buf);
+  return NULL;
+}
+
+
+static int pack_file(t_packer* p, int dirfd, const char* name, const struct stat* st,
+                     unsigned ino, unsigned nlink)
+{
+  int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  off_t left = st->st_size;
+
+  if (fd == -1)
+    return -1;
+  if (st->st_size > UINT32_MAX) {
+    errno = EFBIG;
+    goto fail;
+  }
+  if (emit_header(p, p->rd->path, ino, st->st_mode, nlink, st->st_size, 0, 0))
+    goto fail;
+
+  // read straight into the buffer
+  while (left) {
+    if ((p->used == p->cap) && compress_batch(p, 0))
+      goto fail;
+    size_t n = p->cap - p->used < left ? p->cap - p->used : left;
+    ssize_t rb = read(fd, p->in + p->used, n);
+    if (rb < 0) {
+      if (errno == EINTR)
+        continue;
+      goto fail;
+    }
+    if (!rb) {
+      errno = ESTALE;  /* the file shrank while being packed */
+      goto fail;
+    }
+    p->used += rb;
+    p->rd->cpio_size += rb;
+    p->rd->bytes_read += rb;
+    left -= rb;
+  }
+
+  close(fd);
+  return pad(p);
+
+fail: {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+}
+
+/*
+ * A name of a file with several names (see t_link).
+ */
+static int pack_link(t_packer* p, int dirfd, const char* name, const struct stat* st)
+{
+  t_link* l;
+  int i;
+
+  for (i = 0; i < p->nlinks; i++)
+    if ((p->links[i].ino == st->st_ino) && (p->links[i].dev == st->st_dev))
+      break;
+  if (i == p->nlinks) {
+    if (!(p->nlinks & (p->nlinks + 1))) {
+      t_link* links = realloc(p->links, (2 * p->nlinks + 1) * sizeof(*links));
+      if (!links)
+        return -1;
+      p->links = links;
+    }
+    p->nlinks++;
+    p->links[i] = (t_link){ st->st_dev, st->st_ino, ++p->ino, st->st_nlink, NULL };
+  }
+  l = &p->links[i];
+
+  // the name held back was not the last one
+  if (l->held) {
+    if (emit_header(p, l->held, l->cino, st->st_mode, st->st_nlink, 0, 0, 0))
+      return -1;
+    free(l->held);
+    l->held = NULL;
+  }
+  if (l->left)
+    l->left--;
+  if (l->left)
+    return (l->held = strdup(p->rd->path)) ? 0 : -1;
+  return pack_file(p, dirfd, name, st, l->cino, st->st_nlink);
+}
+
+/*
+ * Packs the held names of the files which have names out of the tree,
+ * with their content.
+ */
+static int pack_held(t_packer* p)
+{
+  struct stat st;
+  int i;
+
+  for (i = 0; i < p->nlinks; i++) {
+    t_link* l = &p->links[i];
+    if (!l->held)
+      continue;
+    snprintf(p->rd->path, sizeof(p->rd->path), "%s", l->held);
+    if (fstatat(p->root, l->held, &st, AT_SYMLINK_NOFOLLOW))
+      return -1;
+    if ((st.st_ino != l->ino) || (st.st_dev != l->dev)) {
+      errno = ESTALE;  /* replaced while being packed */
+      return -1;
+    }
+    if (pack_file(p, p->root, l->held, &st, l->cino, st.st_nlink))
+      return -1;
+    free(l->held);
+    l->held = NULL;
+  }
+  return 0;
+}
+
+/*
+ * Packs the entries of the directory, each one followed by its own
+ * entries if it is a directory. rd->path holds the path of the directory
+ * in the archive, len bytes long.
+ */
+static int pack_dir(t_packer* p, int dirfd, size_t len)
+{
+  t_initrd* rd = p->rd;
+  char** names;
+  int n, i;
+
+  names = list_dir(dirfd, &n);
+  if (!names)
+    return -1;
+
+  for (i = 0; i < n; i++) {
+    const char* name = names[i];
+    struct stat st;
+
+    if (len + 1 + strlen(name) >= sizeof(rd->path)) {
+      errno = ENAMETOOLONG;
+      goto fail;
+    }
+    snprintf(rd->path + len, sizeof(rd->path) - len, "%s%s", len ? "/" : "", name);
+
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW))
+      goto fail;
+    rd->entries++;
+
+    if (S_ISREG(st.st_mode) && (st.st_nlink > 1)) {
+      if (pack_link(p, dirfd, name, &st))
+        goto fail;
+    }
+    else if (S_ISREG(st.st_mode)) {
+      if (pack_file(p, dirfd, name, &st, ++p->ino, 1))
+        goto fail;
+    }
+    else if (S_ISLNK(st.st_mode)) {
+      char target[PATH_MAX];
+      ssize_t tl = readlinkat(dirfd, name, target, sizeof(target));
+      if (tl < 0)
+        goto fail;
+      if (emit_header(p, rd->path, ++p->ino, st.st_mode, 1, tl, 0, 0) ||
+          emit(p, target, tl) || pad(p))
+        goto fail;
+    }
+    else if (S_ISDIR(st.st_mode)) {
+      int sub = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (sub == -1)
+        goto fail;
+      size_t sublen = strlen(rd->path);
+      if (emit_header(p, rd->path, ++p->ino, st.st_mode, 2, 0, 0, 0) ||
+          pack_dir(p, sub, sublen)) {
+        int err = errno;
+        close(sub);
+        errno = err;
+        goto fail;
+      }
+      close(sub);
+    }
+    else {
+      // device nodes, fifos and sockets: no content
+      if (emit_header(p, rd->path, ++p->ino, st.st_mode, 1, 0,
+                      major(st.st_rdev), minor(st.st_rdev)))
+        goto fail;
+    }
+    rd->path[len] = 0;
+  }
+
+  free(names);
+  return 0;
+
+fail:
+  free(names);
+  return -1;
+}
+
+
+int initrd_pack(t_initrd* rd, int dirfd, int out_fd)
+{
+  t_packer p;
+  int ret = -1;
+  int i;
+
+  memset(&p, 0, sizeof(p));
+  p.rd = rd;
+  p.fd = out_fd;
+  p.root = dirfd;
+  p.threads = rd->threads > 0 ? rd->threads : tp_default_threads();
+  rd->path[0] = 0;
+
+  if (!blocks_init(&p.b, rd->format, rd->level)) {
+    p.parallel = 1;
+    p.block_size = p.b.block_size;
+    p.dict = p.b.dict_size;
+    p.outsize = p.b.bound;
+  }
+  else if ((errno != ENOTSUP) || codec_init(&p.c, rd->format, 1, rd->level))
+    goto out;
+  else {
+    p.block_size = BLOCK;
+    p.outsize = BLOCK;
+  }
+
+  p.nblocks = p.threads * (BATCH / p.block_size ? BATCH / p.block_size : 1);
+  p.cap = (size_t)p.nblocks * p.block_size;
+  p.buf = malloc(p.dict + p.cap);
+  p.blocks = calloc(p.nblocks, sizeof(t_block));
+  p.out = malloc(p.nblocks * p.outsize);
+  if (!p.buf || !p.blocks || !p.out) {
+    errno = ENOMEM;
+    goto out;
+  }
+  p.in = p.buf + p.dict;
+
+  if ((!p.parallel || !write_header(&p)) &&
+      !pack_dir(&p, dirfd, 0) &&
+      !pack_held(&p) &&
+      !emit_header(&p, NEWC_TRAILER, 0, 0, 1, 0, 0, 0) &&
+      !compress_batch(&p, 1) &&
+      (!p.parallel || !write_trailer(&p))) {
+    rd->path[0] = 0;
+    ret = 0;
+  }
+
+out:
+  for (i = 0; i < p.nlinks; i++)
+    free(p.links[i].held);
+  free(p.links);
+  blocks_end(&p.b);
+  codec_end(&p.c);
+  free(p.buf);
+  free(p.blocks);
+  free(p.out);
+  return ret;
+}
+
+
+
+/*
+ * Unpacking: the compressed archive is read CHUNK bytes at a time and
+ * decompressed to a buffer of CHUNK bytes, which the newc parser consumes.
+ */
+#define CHUNK           (256 << 10)
+
+typedef struct
+{
+  char*        name;      /* relative to the ramdisk directory */
+  unsigned     ino;       /* regular files: for hard links */
+  unsigned     mode;      /* directories: applied at the end */
+} t_created;
+
+typedef struct
+{
+  t_initrd*    rd;
+  int          in_fd;
+  off_t        offset;    /* of what is not read yet */
+  unsigned long long left;
+
+  t_codec      c;
+  int          started;   /* format known, codec set up */
+  char*        in;
+  char*        out;
+  size_t       pos;       /* decompressed bytes not consumed: out[pos, avail) */
+  size_t       avail;
+
+  int          dirfd;     /* -1 to list */
+  char*        parent;    /* directory of the last entry, and its fd */
+  int          parent_fd;
+
+  t_created*   links;
+  int          nlinks;
+  t_created*   dirs;
+  int          ndirs;
+} t_unpacker;
+
+
+static int bad_archive(t_unpacker* u, const char* error)
+{
+  u->rd->error = error;
+  errno = EINVAL;
+  return -1;
+}
+
+static const char* not_built_in(int fmt)
+{
+  switch (fmt) {
+    case fmt_xz:
+      return "xz compression not built in (HAS_LZMA)";
+    case fmt_lzma:
+      return "lzma compression not built in (HAS_LZMA)";
+    case fmt_zstd:
+      return "zstd compression not built in (HAS_ZSTD)";
+    default:
+      return "compression not built in";
+  }
+}
+
+/*
+ * Decompresses more of the archive, the format of which is found from its
+ * first bytes.
+ */
+static int decompress_more(t_unpacker* u)
+{
+  u->pos = u->avail = 0;
+
+  while (!u->avail) {
+    if (!u->c.avail_in && u->left) {
+      size_t n = u->left < CHUNK ? u->left : CHUNK;
+      ssize_t rb = pread(u->in_fd, u->in, n, u->offset);
+      if (rb < 0) {
+        if (errno == EINTR)
+          continue;
+        return -1;
+      }
+      if (!rb)
+        return bad_archive(u, "truncated archive");
+      u->offset += rb;
+      u->left -= rb;
+      u->rd->bytes_read += rb;
+      u->rd->size += rb;
+      u->c.next_in = u->in;
+      u->c.avail_in = rb;
+    }
+
+    if (!u->started) {
+      int fmt = fmt_detect(u->c.next_in, u->c.avail_in);
+      const char* next_in = u->c.next_in;
+      size_t avail_in = u->c.avail_in;
+      if (fmt < 0)
+        return bad_archive(u, "unknown compression");
+      if (!fmt_supported(fmt))
+        return bad_archive(u, not_built_in(fmt));
+      if (codec_init(&u->c, fmt, 0, 0))
+        return -1;
+      u->c.next_in = next_in;
+      u->c.avail_in = avail_in;
+      u->rd->format = fmt;
+      u->started = 1;
+    }
+
+    u->c.next_out = u->out;
+    u->c.avail_out = CHUNK;
+    int ret = codec_run(&u->c, !u->left);
+    if (ret < 0)
+      return errno == EINVAL ? bad_archive(u, u->c.error) : -1;
+    u->avail = CHUNK - u->c.avail_out;
+    if (!u->avail && ((ret == 1) || (!u->left && !u->c.avail_in)))
+      return bad_archive(u, "truncated archive");
+  }
+  return 0;
+}
+
+/*
+ * Consumes len bytes of the archive, copied to buf unless it is NULL.
+ */
+static int consume(t_unpacker* u, void* buf, size_t len)
+{
+  char* d = buf;
+
+  while (len) {
+    if ((u->pos == u->avail) && decompress_more(u))
+      return -1;
+    size_t n = u->avail - u->pos < len ? u->avail - u->pos : len;
+    if (d) {
+      memcpy(d, u->out + u->pos, n);
+      d += n;
+    }
+    u->pos += n;
+    u->rd->cpio_size += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int align(t_unpacker* u)
+{
+  return consume(u, NULL, -u->rd->cpio_size & 3);
+}
+
+/*
+ * Writes len bytes of the archive to fd, straight from the decompression
+ * buffer.
+ */
+static int consume_to(t_unpacker* u, int fd, unsigned long long len)
+{
+  while (len) {
+    if ((u->pos == u->avail) && decompress_more(u))
+      return -1;
+    size_t n = u->avail - u->pos < len ? u->avail - u->pos : len;
+    if (write_all(fd, u->out + u->pos, n))
+      return -1;
+    u->rd->bytes_written += n;
+    u->pos += n;
+    u->rd->cpio_size += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int add_created(t_created** list, int* n, const char* name, unsigned ino, unsigned mode)
+{
+  t_created* more = realloc(*list, (*n + 1) * sizeof(t_created));
+  if (!more)
+    return -1;
+  *list = more;
+  if (!(more[*n].name = strdup(name)))
+    return -1;
+  more[*n].ino = ino;
+  more[*n].mode = mode;
+  (*n)++;
+  return 0;
+}
+
+/*
+ * Names must stay under the ramdisk directory: no absolute names, no "..".
+ * A leading "./" is dropped. Returns NULL for the top directory itself.
+ */
+static const char* entry_name(t_unpacker* u, const char* name, int* unsafe)
+{
+  const char* c;
+
+  *unsafe = 0;
+  while ((name[0] == '.') && (name[1] == '/'))
+    name += 2;
+  if (!name[0] || !strcmp(name, "."))
+    return NULL;
+
+  if (name[0] == '/')
+    *unsafe = 1;
+  for (c = name; c; c = strchr(c, '/')) {
+    if (*c == '/')
+      c++;
+    if ((c[0] == '.') && (c[1] == '.') && (!c[2] || (c[2] == '/')))
+      *unsafe = 1;
+  }
+  if (*unsafe)
+    bad_archive(u, "entry outside of the archive directory");
+  return name;
+}
+
+/*
+ * Opens the directory holding name, one component at a time without
+ * following symbolic links. Missing directories are created. *base is set
+ * to the last component of name; a name without a directory gives dirfd
+ * itself.
+ */
+static int open_parent(t_unpacker* u, const char* name, const char** base)
+{
+  const char* slash = strrchr(name, '/');
+
+  if (!slash) {
+    *base = name;
+    return u->dirfd;
+  }
+  *base = slash + 1;
+
+  char* path = strndup(name, slash - name);
+  if (!path)
+    return -1;
+
+  int fd = u->dirfd;
+  char* comp;
+  char* save;
+  for (comp = strtok_r(path, "/", &save); comp; comp = strtok_r(NULL, "/", &save)) {
+    int sub = openat(fd, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if ((sub == -1) && (errno == ENOENT) && !mkdirat(fd, comp, 0755))
+      sub = openat(fd, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    int err = errno;
+    if (fd != u->dirfd)
+      close(fd);
+    if (sub == -1) {
+      free(path);
+      errno = err;
+      return -1;
+    }
+    fd = sub;
+  }
+  free(path);
+  return fd;
+}
+
+/*
+ * open_parent, the directory being kept open for the next entries.
+ */
+static int parent_of(t_unpacker* u, const char* name, const char** base)
+{
+  const char* slash = strrchr(name, '/');
+
+  if (!slash) {
+    *base = name;
+    return u->dirfd;
+  }
+
+  size_t len = slash - name;
+  if (u->parent && (strlen(u->parent) == len) && !strncmp(u->parent, name, len)) {
+    *base = slash + 1;
+    return u->parent_fd;
+  }
+
+  if (u->parent) {
+    close(u->parent_fd);
+    free(u->parent);
+    u->parent = NULL;
+  }
+
+  char* path = strndup(name, len);
+  if (!path)
+    return -1;
+  int fd = open_parent(u, name, base);
+  if (fd == -1) {
+    free(path);
+    return -1;
+  }
+  u->parent = path;
+  u->parent_fd = fd;
+  return fd;
+}
+
+static int unpack_file(t_unpacker* u, const char* name, unsigned ino, unsigned mode,
+                       unsigned nlink, unsigned long long size)
+{
+  const char* base;
+  int pfd = parent_of(u, name, &base);
+  int fd = -1;
+  int i;
+
+  if (pfd == -1)
+    return -1;
+
+  // further names of a hard linked file: the content comes with one of them
+  for (i = 0; (nlink > 1) && (i < u->nlinks); i++)
+    if (u->links[i].ino == ino)
+      break;
+  if ((nlink > 1) && (i < u->nlinks)) {
+    const char* first;
+    int ffd = open_parent(u, u->links[i].name, &first);
+    if (ffd == -1)
+      return -1;
+    int ret = linkat(ffd, first, pfd, base, 0);
+    int err = errno;
+    if (ffd != u->dirfd)
+      close(ffd);
+    errno = err;
+    if (ret)
+      return -1;
+    if (!size)
+      return 0;
+    fd = openat(pfd, base, O_WRONLY | O_TRUNC | O_NOFOLLOW | O_CLOEXEC);
+  }
+  else {
+    if ((nlink > 1) && add_created(&u->links, &u->nlinks, name, ino, mode))
+      return -1;
+    fd = openat(pfd, base, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  }
+  if (fd == -1)
+    return -1;
+
+  if (consume_to(u, fd, size) || fchmod(fd, mode & 07777)) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return close(fd);
+}
+
+static int unpack_entry(t_unpacker* u, const char* name, unsigned ino, unsigned mode,
+                        unsigned nlink, unsigned long long size, dev_t rdev,
+                        const char* target)
+{
+  const char* base;
+  int pfd;
+
+  if (S_ISREG(mode))
+    return unpack_file(u, name, ino, mode, nlink, size);
+
+  pfd = parent_of(u, name, &base);
+  if (pfd == -1)
+    return -1;
+
+  if (S_ISDIR(mode)) {
+    // writable until the end, for the entries it holds
+    if (mkdirat(pfd, base, 0700)) {
+      struct stat st;
+      int i;
+
+      if ((errno != EEXIST) || fstatat(pfd, base, &st, AT_SYMLINK_NOFOLLOW))
+        return -1;
+      if (!S_ISDIR(st.st_mode)) {
+        errno = EEXIST;
+        return -1;
+      }
+      // given again: the last mode wins
+      for (i = u->ndirs - 1; i >= 0; i--)
+        if (!strcmp(u->dirs[i].name, name)) {
+          u->dirs[i].mode = mode;
+          return 0;
+        }
+    }
+    return add_created(&u->dirs, &u->ndirs, name, ino, mode);
+  }
+  if (S_ISLNK(mode))
+    return symlinkat(target, pfd, base);
+
+  if (mknodat(pfd, base, (mode & S_IFMT) | 0600, rdev)) {
+    if ((errno == EPERM) && (S_ISCHR(mode) || S_ISBLK(mode))) {
+      u->rd->skipped++;
+      return 0;
+    }
+    return -1;
+  }
+  return fchmodat(pfd, base, mode & 07777, 0);
+}
+
+static int parse_hex(const char* s, unsigned* v)
+{
+  int i;
+
+  *v = 0;
+  for (i = 0; i < 8; i++) {
+    char c = s[i];
+    int d = c >= '0' && c <= '9' ? c - '0' :
+            c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+            c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+    if (d < 0)
+      return -1;
+    *v = (*v << 4) | d;
+  }
+  return 0;
+}
+
+static int unpack_entries(t_unpacker* u)
+{
+  t_initrd* rd = u->rd;
+  char hdr[6 + 13 * 8];
+  char target[PATH_MAX];
+
+  for (;;) {
+    unsigned f[13];
+    int i, unsafe;
+
+    rd->path[0] = 0;
+    if (consume(u, hdr, sizeof(hdr)))
+      return -1;
+    if (memcmp(hdr, NEWC_MAGIC, 6) && memcmp(hdr, "070702", 6))
+      return bad_archive(u, "not a newc cpio archive");
+    for (i = 0; i < 13; i++)
+      if (parse_hex(hdr + 6 + 8 * i, &f[i]))
+        return bad_archive(u, "bad cpio header");
+
+    unsigned ino = f[0], mode = f[1], nlink = f[4], size = f[6];
+    unsigned namesize = f[11];
+    if (!namesize || (namesize > sizeof(rd->path)))
+      return bad_archive(u, "bad cpio header");
+    if (consume(u, rd->path, namesize) || align(u)) {
+      rd->path[0] = 0;
+      return -1;
+    }
+    if (rd->path[namesize - 1])
+      return bad_archive(u, "bad cpio header");
+    if (!strcmp(rd->path, NEWC_TRAILER))
+      return 0;
+
+    if (S_ISLNK(mode)) {
+      if (size >= sizeof(target))
+        return bad_archive(u, "symbolic link too long");
+      if (consume(u, target, size) || align(u))
+        return -1;
+      target[size] = 0;
+    }
+
+    const char* name = entry_name(u, rd->path, &unsafe);
+    if (unsafe)
+      return -1;
+    if (name)
+      rd->entries++;
+
+    if (name && rd->list)
+      rd->list(rd->ctx, name, mode, size, S_ISLNK(mode) ? target : NULL);
+
+    int written = 0;
+    if (name && (u->dirfd != -1)) {
+      if (unpack_entry(u, name, ino, mode, nlink, size,
+                       makedev(f[9], f[10]), target))
+        return -1;
+      written = S_ISREG(mode);
+    }
+
+    if (!S_ISLNK(mode) && ((!written && consume(u, NULL, size)) || align(u)))
+      return -1;
+  }
+}
+
+/*
+ * Modes of the directories, the deepest ones first. Each one is opened
+ * as the entries were, without following symbolic links.
+ */
+static int chmod_dirs(t_unpacker* u)
+{
+  int i;
+
+  for (i = u->ndirs - 1; i >= 0; i--) {
+    const char* base;
+    int pfd = parent_of(u, u->dirs[i].name, &base);
+    int fd = pfd == -1 ? -1 :
+             openat(pfd, base, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if ((fd == -1) || fchmod(fd, u->dirs[i].mode & 07777)) {
+      int err = errno;
+      if (fd != -1)
+        close(fd);
+      snprintf(u->rd->path, sizeof(u->rd->path), "%s", u->dirs[i].name);
+      errno = err;
+      return -1;
+    }
+    close(fd);
+  }
+  return 0;
+}
+
+int initrd_probe(t_initrd* rd, int in_fd, off_t offset, unsigned long long size)
+{
+  char magic[16];
+  t_codec c;
+  ssize_t rb;
+
+  rd->error = NULL;
+  do
+    rb = pread(in_fd, magic, size < sizeof(magic) ? size : sizeof(magic), offset);
+  while ((rb < 0) && (errno == EINTR));
+  if (rb < 0)
+    return -1;
+
+  int fmt = fmt_detect(magic, rb);
+  if (!rb)
+    rd->error = "truncated archive";
+  else if (fmt < 0)
+    rd->error = "unknown compression";
+  else if (!fmt_supported(fmt))
+    rd->error = not_built_in(fmt);
+  if (rd->error) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (codec_init(&c, fmt, 0, 0))
+    return -1;
+  codec_end(&c);
+  rd->format = fmt;
+  return 0;
+}
+
+int initrd_unpack(t_initrd* rd, int in_fd, off_t offset, unsigned long long size, int dirfd)
+{
+  t_unpacker u;
+  int ret = -1;
+  int i;
+
+  memset(&u, 0, sizeof(u));
+  u.rd = rd;
+  u.in_fd = in_fd;
+  u.offset = offset;
+  u.left = size;
+  u.dirfd = dirfd;
+  u.in = malloc(CHUNK);
+  u.out = malloc(CHUNK);
+  rd->path[0] = 0;
+  rd->error = NULL;
+
+  if (!u.in || !u.out) {
+    free(u.in);
+    free(u.out);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  if (!unpack_entries(&u) && ((dirfd == -1) || !chmod_dirs(&u))) {
+    rd->path[0] = 0;
+    ret = 0;
+  }
+
+  int err = errno;
+  codec_end(&u.c);
+  if (u.parent) {
+    close(u.parent_fd);
+    free(u.parent);
+  }
+  for (i = 0; i < u.nlinks; i++)
+    free(u.links[i].name);
+  for (i = 0; i < u.ndirs; i++)
+    free(u.dirs[i].name);
+  free(u.links);
+  free(u.dirs);
+  free(u.in);
+  free(u.out);
+  errno = err;
+  return ret;
+}
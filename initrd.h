@@ -0,0 +1,73 @@
+/* initrd.h - ramdisk archives: newc cpio, compressed
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef INITRD_H_
+#define INITRD_H_
+
+#include <limits.h>
+#include <sys/types.h>
+
+#include "compress.h"
+
+typedef struct
+{
+  int          format;        /* enum ramdisk_format, gzip by default;
+                                 * initrd_unpack sets it to the one found */
+  int          level;         /* 0 for the default of the format (gzip: 9) */
+  int          threads;       /* compressing, 0 for one per online CPU */
+
+  unsigned long long entries;
+  unsigned long long cpio_size;   /* uncompressed archive */
+  unsigned long long size;        /* compressed archive */
+  unsigned long long bytes_read;  /* file contents, or compressed archive */
+  unsigned long long bytes_written;  /* file contents unpacked */
+  unsigned long long skipped;     /* device nodes not created (not root) */
+
+  /* initrd_unpack: called for each entry, target being NULL but for
+   * symbolic links */
+  void         (*list)(void* ctx, const char* name, unsigned mode,
+                       unsigned long long size, const char* target);
+  void*        ctx;
+
+  char         path[PATH_MAX];    /* entry being worked on, for errors */
+  const char*  error;             /* what is wrong with the archive (EINVAL) */
+} t_initrd;
+
+void initrd_init(t_initrd* rd);
+
+/*
+ * Writes the tree under dirfd to out_fd as a newc cpio archive, compressed
+ * in rd->format. The archive only depends on the names, types, permissions
+ * and content of the files: entries are sorted, owners are root, times are
+ * 0 and inode numbers follow the order of the entries. The names of a hard
+ * linked file share its number, the content coming with the last one. The
+ * compressed archive does not depend on the number of threads either
+ * (gzip, lz4 and xz are compressed in parallel). Returns -1 with errno
+ * set on errors, rd->path telling where.
+ */
+int initrd_pack(t_initrd* rd, int dirfd, int out_fd);
+
+/*
+ * Finds the format of the archive of size bytes at offset of in_fd, and
+ * checks that it is built in and can be decompressed, before anything is
+ * created for it. Returns -1 with errno set otherwise, rd->error telling
+ * why for archives that are not valid or not supported.
+ */
+int initrd_probe(t_initrd* rd, int in_fd, off_t offset, unsigned long long size);
+
+/*
+ * Reads the newc cpio archive of size bytes at offset of in_fd, in any
+ * built in format (see compress.h), and creates its entries under dirfd, or only lists them if dirfd
+ * is -1. Entries cannot be created out of dirfd: absolute names and ".."
+ * are refused, and symbolic links are not followed. Owners and times are
+ * not restored. Memory use does not depend on the size of the archive.
+ * Returns -1 with errno set on errors, rd->path telling where.
+ */
+int initrd_unpack(t_initrd* rd, int in_fd, off_t offset, unsigned long long size, int dirfd);
+
+#endif // INITRD_H_
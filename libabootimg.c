@@ -0,0 +1,3291 @@
+/* libabootimg -  Manipulate (read, modify, create) Android Boot Images
+ * Copyright (c) 2010-2011 Gilles Grandou <gilles@grandou.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* copy_file_range */
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <aio.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include "minicript/sha.h"
+#include "minicript/sha256.h"
+#include "minicript/sha_mb.h"
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h> /* BLKGETSIZE64 */
+#endif
+
+#ifdef __CYGWIN__
+#include <sys/ioctl.h>
+#include <cygwin/fs.h> /* BLKGETSIZE64 */
+#endif
+
+#if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
+#include <sys/disk.h> /* DIOCGMEDIASIZE */
+#include <sys/sysctl.h>
+#endif
+
+#if defined(__APPLE__)
+# include <sys/disk.h> /* DKIOCGETBLOCKCOUNT */
+#endif
+
+
+#ifdef HAS_BLKID
+#include <blkid/blkid.h>
+#endif
+
+#include "bootimg.h"
+#include "initrd.h"
+#include "compress.h"
+#include "libabootimg.h"
+
+
+enum id_algo {
+  id_sha1,
+  id_sha256
+};
+
+
+enum part {
+  part_kernel,
+  part_ramdisk,
+  part_second,
+  part_devtree,
+  nparts
+};
+
+
+/* what to do with the unused end of a block device */
+enum tail {
+  tail_keep,
+  tail_discard,
+  tail_zeroout
+};
+
+
+/*
+ * how much of a component is read, hashed or written at once; this bounds
+ * the memory used whatever the size of the image
+ */
+#ifndef IO_WINDOW
+#define IO_WINDOW       (1 << 20)
+#endif
+
+
+/*
+ * where the content of a component is read from when writing the image
+ */
+typedef struct
+{
+  int          fd;        /* replacement file, or the image itself */
+  char*        fname;
+  unsigned     offset;    /* of the content in fd */
+  const char*  map;       /* the content, when mapped */
+} t_source;
+
+
+#define MAX_CONF_LEN    4096
+
+typedef struct t_writer t_writer;
+
+struct abootimg
+{
+  unsigned     size;
+  unsigned     orig_size;     /* as read from the image */
+  int          is_blkdev;
+  int          id_algo;
+  int          id_algo_set;
+  int          tail;
+  int          direct;        /* O_DIRECT writes: 1 forced, 0 never, -1 on block devices */
+  int          diff_write;    /* only write the pages which differ */
+  int          verify;        /* read back what was written */
+  int          force;         /* --pack-initrd -f */
+  int          threads;       /* --pack-initrd -j, 0 for one per CPU */
+  int          list;          /* --unpack-initrd -l */
+  int          format;        /* --compress, -1 if not given */
+  int          quiet;         /* no progress report */
+  t_abootimg_io io;
+  int          id_known;      /* header.id already computed */
+  int          prepared;      /* inputs read by abootimg_prepare */
+
+  unsigned long long bytes_read;
+  unsigned long long bytes_written;
+  unsigned long long bytes_holes;
+  unsigned long long pages_same;    /* not written by --diff-write */
+  unsigned long long pages_diff;
+  unsigned     write_calls;
+  double       write_time;    /* seconds spent in write calls */
+  unsigned long long bytes_verified;
+  double       verify_time;
+
+  char*        fname;
+  char*        config_fname;
+  char*        kernel_fname;
+  char*        ramdisk_fname;
+  char*        second_fname;
+  char*        devtree_fname;
+  char*        idcache_fname;
+  char**       targets;       /* --create with several targets */
+  int          ntargets;
+
+  FILE*        stream;
+  char         config_args[MAX_CONF_LEN];  /* -c entries, one per line */
+
+  boot_img_hdr header;
+  boot_img_hdr orig_header;   /* as read from the image */
+
+  t_source     src[nparts];
+  t_writer*    writer;        /* while the image is written */
+
+  char         error[256];    /* last error */
+  int          error_errno;
+};
+
+
+/*
+ * Pending writes of consecutive bytes of the image: chunks of buf and
+ * runs of the shared zero page, submitted together with pwritev.
+ */
+#ifdef IOV_MAX
+#define WRITE_IOVS      (IOV_MAX < 64 ? IOV_MAX : 64)
+#else
+#define WRITE_IOVS      16
+#endif
+
+struct t_writer
+{
+  struct iovec iov[WRITE_IOVS];
+  int          n;
+  off_t        offset;    /* where iov[0] goes */
+  size_t       len;       /* pending bytes */
+  char*        buf;       /* IO_WINDOW bytes */
+  size_t       used;      /* of buf */
+  const char*  zero;      /* one zeroed page */
+  size_t       zero_len;
+  size_t       hole_size; /* filesystem block size if holes can be punched */
+
+  /* O_DIRECT mode: pending bytes are copied to stage, which holds
+   * [offset, offset+len) of the image with offset aligned to align */
+  int          direct_fd;
+  size_t       align;
+  char*        stage;     /* IO_WINDOW bytes, aligned */
+  char*        block;     /* one aligned block, for read-modify-write */
+
+  /* --diff-write: what the image currently holds at [cmp_offset,
+   * cmp_offset+cmp_len), compared unit bytes at a time */
+  char*        cmp;       /* IO_WINDOW bytes, aligned */
+  off_t        cmp_offset;
+  size_t       cmp_len;
+  size_t       unit;
+
+  /* --verify: digest of each page queued for writing, 0 for the pages
+   * which were not entirely queued in order */
+  uint64_t*    sums;
+  size_t       nsums;
+  HASH_CTX     page_ctx;
+  off_t        page_at;   /* next byte expected by page_ctx, -1 if none */
+};
+
+
+/*
+ * read-only mapping of a byte range of the image
+ */
+typedef struct
+{
+  char*        map;       /* page aligned start of the mapping */
+  size_t       maplen;
+  const char*  data;      /* first byte of the range */
+  size_t       size;
+  size_t       dropped;   /* mapping bytes already given back */
+} t_view;
+
+
+/*
+ * id cache sidecar (<bootimg>.idcache)
+ *
+ * Holds the SHA midstate after the kernel and its size, so that an id can
+ * be computed without rehashing an unchanged kernel. The kernel is
+ * recognized by its length and a fast non-cryptographic fingerprint.
+ */
+#define IDCACHE_MAGIC   "ABIDC002"
+
+typedef struct
+{
+  char         magic[8];
+  uint64_t     fingerprint;
+  uint32_t     kernel_size;
+  uint32_t     id_algo;
+  uint32_t     hit;        /* the last write resumed from the midstate */
+  uint32_t     reserved;
+  uint32_t     id[8];      /* id written by the last write */
+  uint64_t     count;      /* SHA midstate */
+  uint8_t      buf[64];
+  uint32_t     state[8];
+} t_idcache;
+
+
+
+/*
+ * Errors are trapped instead of ending the process: every entry point of
+ * the library sets a trap, abort_* keep the message in it and jump back
+ * there, and the entry point returns an error code. The threads writing
+ * several targets set their own.
+ *
+ * The frames in between are jumped over, so what they hold while they
+ * may abort (descriptors, buffers, mappings) is registered on the trap
+ * and released by whoever catches the error.
+ */
+#define MAX_HELD 16
+
+enum { held_none, held_fd, held_mem, held_map, held_file };
+
+typedef struct
+{
+  int          kind;
+  int          fd;
+  void*        p;
+  size_t       len;
+} t_held;
+
+typedef struct
+{
+  jmp_buf      env;
+  char         msg[256];
+  int          code;
+  int          err;       /* errno, for abootimg_esys */
+  t_held       held[MAX_HELD];
+  int          nheld;
+} t_trap;
+
+static __thread t_trap* trap;
+
+/*
+ * Registers a resource on the current trap, returns its handle for
+ * let_go. hold_mem(NULL) is harmless, for buffers allocated later.
+ */
+static int hold(int kind, int fd, void* p, size_t len)
+{
+  // only reached outside of an entry point by a bug of the library
+  if (!trap || (trap->nheld == MAX_HELD))
+    abort();
+  trap->held[trap->nheld] = (t_held){ kind, fd, p, len };
+  return trap->nheld++;
+}
+
+#define hold_fd(fd)        hold(held_fd, fd, NULL, 0)
+#define hold_mem(p)        hold(held_mem, -1, p, 0)
+#define hold_map(p, len)   hold(held_map, -1, p, len)
+#define hold_file(f)       hold(held_file, -1, f, 0)
+
+/*
+ * The owner released (or kept) the resource itself.
+ */
+static void let_go(int h)
+{
+  trap->held[h].kind = held_none;
+  while (trap->nheld && (trap->held[trap->nheld - 1].kind == held_none))
+    trap->nheld--;
+}
+
+static void let_go_since(int h)
+{
+  while (trap->nheld > h)
+    let_go(trap->nheld - 1);
+}
+
+static void release_held(t_trap* tr)
+{
+  while (tr->nheld) {
+    t_held* h = &tr->held[--tr->nheld];
+    switch (h->kind) {
+    case held_fd:   close(h->fd); break;
+    case held_mem:  free(h->p); break;
+    case held_map:  if (h->p) munmap(h->p, h->len); break;
+    case held_file: fclose(h->p); break;
+    }
+  }
+}
+
+static void abort_perror(char* str)
+{
+  int err = errno;
+
+  // only reached outside of an entry point by a bug of the library
+  if (!trap)
+    abort();
+  snprintf(trap->msg, sizeof(trap->msg), "%s: %s", str, strerror(err));
+  trap->code = abootimg_esys;
+  trap->err = err;
+  longjmp(trap->env, 1);
+}
+
+static void abort_printf(char *fmt, ...)
+{
+  va_list args;
+
+  if (!trap)
+    abort();
+  va_start(args, fmt);
+  vsnprintf(trap->msg, sizeof(trap->msg), fmt, args);
+  va_end(args);
+  trap->msg[strcspn(trap->msg, "\n")] = 0;
+  trap->code = abootimg_einval;
+  trap->err = 0;
+  longjmp(trap->env, 1);
+}
+
+
+/*
+ * Messages go to the log callback of the handle, or to stdout (progress
+ * and command output) and stderr (warnings).
+ */
+static void vlog(t_abootimg* img, int level, const char* fmt, va_list args)
+{
+  char buf[256];
+  char* msg = buf;
+  va_list again;
+
+  va_copy(again, args);
+  int len = vsnprintf(buf, sizeof(buf), fmt, args);
+  if ((len >= (int)sizeof(buf)) && (msg = malloc(len + 1)))
+    vsnprintf(msg, len + 1, fmt, again);
+  else
+    msg = buf;  /* truncated if out of memory */
+  va_end(again);
+
+  if (img->io.log)
+    img->io.log(img->io.ctx, level, msg);
+  else
+    fputs(msg, level == log_info ? stdout : stderr);
+
+  if (msg != buf)
+    free(msg);
+}
+
+/*
+ * Progress report and command output, silenced when several targets are
+ * written at once.
+ */
+static void report(t_abootimg* img, const char* fmt, ...)
+{
+  va_list args;
+
+  if (img->quiet)
+    return;
+  va_start(args, fmt);
+  vlog(img, log_info, fmt, args);
+  va_end(args);
+}
+
+static void warn(t_abootimg* img, const char* fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  vlog(img, log_warning, fmt, args);
+  va_end(args);
+}
+
+
+/*
+ * Files are opened through the open callback of the handle, if any.
+ */
+static int open_file(t_abootimg* img, const char* fname, int flags, mode_t mode)
+{
+  if (img->io.open)
+    return img->io.open(img->io.ctx, fname, flags, mode);
+  return open(fname, flags, mode);
+}
+
+static FILE* fopen_file(t_abootimg* img, const char* fname, const char* mode)
+{
+  int flags;
+
+  if (!strcmp(mode, "r"))
+    flags = O_RDONLY;
+  else if (!strcmp(mode, "r+"))
+    flags = O_RDWR;
+  else if (!strcmp(mode, "w"))
+    flags = O_WRONLY | O_CREAT | O_TRUNC;
+  else
+    flags = O_RDWR | O_CREAT | O_TRUNC;
+
+  int fd = open_file(img, fname, flags, 0666);
+  if (fd == -1)
+    return NULL;
+  FILE* f = fdopen(fd, mode);
+  if (!f)
+    close(fd);
+  return f;
+}
+
+
+static int blkgetsize(int fd, unsigned long long *pbsize)
+{
+# if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
+  return ioctl(fd, DIOCGMEDIASIZE, pbsize);
+# elif defined(__APPLE__)
+  return ioctl(fd, DKIOCGETBLOCKCOUNT, pbsize);
+# elif defined(__NetBSD__)
+  // does a suitable ioctl exist?
+  // return (ioctl(fd, DIOCGDINFO, &label) == -1);
+  return 1;
+# elif defined(__linux__) || defined(__CYGWIN__)
+  return ioctl(fd, BLKGETSIZE64, pbsize);
+# elif defined(__GNU__)
+  // does a suitable ioctl for HURD exist?
+  return 1;
+# else
+  return 1;
+# endif
+
+}
+
+static char* idcache_name(const char* fname)
+{
+  char* name = malloc(strlen(fname) + sizeof(".idcache"));
+  if (!name)
+    abort_perror("");
+  strcpy(name, fname);
+  strcat(name, ".idcache");
+  return name;
+}
+
+
+
+static enum abootimg_command parse_args(int argc, char** argv, t_abootimg* img)
+{
+  enum abootimg_command cmd = cmd_none;
+  int i;
+
+  if (argc<2)
+    return cmd_none;
+
+  if (!strcmp(argv[1], "-h")) {
+    return cmd_help;
+  }
+  else if (!strcmp(argv[1], "-i")) {
+    cmd=cmd_info;
+  }
+  else if (!strcmp(argv[1], "-x")) {
+    cmd=cmd_extract;
+  }
+  else if (!strcmp(argv[1], "-u")) {
+    cmd=cmd_update;
+  }
+  else if (!strcmp(argv[1], "--create")) {
+    cmd=cmd_create;
+  }
+  else if (!strcmp(argv[1], "--pack-initrd")) {
+    cmd=cmd_pack_initrd;
+  }
+  else if (!strcmp(argv[1], "--unpack-initrd")) {
+    cmd=cmd_unpack_initrd;
+  }
+  else
+    return cmd_none;
+
+  switch(cmd) {
+    case cmd_none:
+    case cmd_help:
+	    break;
+
+    case cmd_info:
+      if (argc != 3)
+        return cmd_none;
+      img->fname = argv[2];
+      break;
+
+    case cmd_pack_initrd:
+      i = 2;
+      for (; i < argc; i++) {
+        if (!strcmp(argv[i], "-f"))
+          img->force = 1;
+        else if (!strcmp(argv[i], "-j") && (i + 1 < argc) && (atoi(argv[i + 1]) > 0))
+          img->threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--compress") && (i + 1 < argc)) {
+          if ((img->format = fmt_by_name(argv[++i])) < 0)
+            return cmd_none;
+        }
+        else
+          break;
+      }
+      if (argc - i > 2)
+        return cmd_none;
+      img->fname = i < argc ? argv[i] : "initrd.img";
+      img->ramdisk_fname = i + 1 < argc ? argv[i + 1] : "ramdisk";
+      break;
+
+    case cmd_unpack_initrd:
+      i = 2;
+      if ((i < argc) && !strcmp(argv[i], "-l")) {
+        img->list = 1;
+        i++;
+      }
+      if (argc - i > 2)
+        return cmd_none;
+      img->fname = i < argc ? argv[i] : "initrd.img";
+      img->ramdisk_fname = i + 1 < argc ? argv[i + 1] : "ramdisk";
+      break;
+      
+    case cmd_extract:
+      if ((argc < 3) || (argc > 8))
+        return cmd_none;
+      img->fname = argv[2];
+      if (argc >= 4)
+        img->config_fname = argv[3];
+      if (argc >= 5)
+        img->kernel_fname = argv[4];
+      if (argc >= 6)
+        img->ramdisk_fname = argv[5];
+      if (argc >= 7)
+        img->second_fname = argv[6];
+      if (argc >= 8)
+        img->devtree_fname = argv[7];
+      break;
+
+    case cmd_update:
+    case cmd_create:
+      if (argc < 3)
+        return cmd_none;
+      img->fname = argv[2];
+      img->config_fname = NULL;
+      img->kernel_fname = NULL;
+      img->ramdisk_fname = NULL;
+      img->second_fname = NULL;
+      img->devtree_fname = NULL;
+      for(i=3; i<argc; i++) {
+        if (!strcmp(argv[i], "-c")) {
+          if (++i >= argc)
+            return cmd_none;
+          unsigned len = strlen(argv[i]);
+          if (strlen(img->config_args)+len+1 >= MAX_CONF_LEN)
+            abort_printf("too many config parameters.\n");
+          strcat(img->config_args, argv[i]);
+          strcat(img->config_args, "\n");
+        }
+        else if (!strcmp(argv[i], "-f")) {
+          if (++i >= argc)
+            return cmd_none;
+          img->config_fname = argv[i];
+        }
+        else if (!strcmp(argv[i], "-k")) {
+          if (++i >= argc)
+            return cmd_none;
+          img->kernel_fname = argv[i];
+        }
+        else if (!strcmp(argv[i], "-r")) {
+          if (++i >= argc)
+            return cmd_none;
+          img->ramdisk_fname = argv[i];
+        }
+        else if (!strcmp(argv[i], "-s")) {
+          if (++i >= argc)
+            return cmd_none;
+          img->second_fname = argv[i];
+        }
+        else if (!strcmp(argv[i], "-t")) {
+          if (++i >= argc)
+            return cmd_none;
+          img->devtree_fname = argv[i];
+        }
+        else if (!strcmp(argv[i], "--id-cache")) {
+          img->idcache_fname = idcache_name(img->fname);
+        }
+        else if (!strcmp(argv[i], "--direct")) {
+          img->direct = 1;
+        }
+        else if (!strcmp(argv[i], "--buffered")) {
+          img->direct = 0;
+        }
+        else if (!strcmp(argv[i], "--diff-write")) {
+          img->diff_write = 1;
+        }
+        else if (!strcmp(argv[i], "--verify")) {
+          img->verify = 1;
+        }
+        else if (!strcmp(argv[i], "--compress")) {
+          if (++i >= argc)
+            return cmd_none;
+          if ((img->format = fmt_by_name(argv[i])) < 0)
+            return cmd_none;
+        }
+        else if (!strcmp(argv[i], "--tail")) {
+          if (++i >= argc)
+            return cmd_none;
+          if (!strcmp(argv[i], "keep"))
+            img->tail = tail_keep;
+          else if (!strcmp(argv[i], "discard"))
+            img->tail = tail_discard;
+          else if (!strcmp(argv[i], "zeroout"))
+            img->tail = tail_zeroout;
+          else
+            return cmd_none;
+        }
+        else if ((cmd == cmd_create) && (argv[i][0] != '-')) {
+          if (!img->targets) {
+            img->targets = calloc(argc, sizeof(char*));
+            if (!img->targets)
+              abort_perror("");
+            img->targets[img->ntargets++] = img->fname;
+          }
+          img->targets[img->ntargets++] = argv[i];
+        }
+        else
+          return cmd_none;
+      }
+      if ((cmd == cmd_create) && (!img->kernel_fname || !img->ramdisk_fname))
+        return cmd_none;
+      break;
+  }
+  
+  return cmd;
+}
+
+
+
+/*
+ * Offsets of the components in the image, see the layout in bootimg.h.
+ */
+static void get_layout(const boot_img_hdr* h, unsigned* offset, unsigned* size)
+{
+  unsigned psize = h->page_size;
+  unsigned pos = psize;
+  int i;
+
+  size[part_kernel] = h->kernel_size;
+  size[part_ramdisk] = h->ramdisk_size;
+  size[part_second] = h->second_size;
+  size[part_devtree] = h->dt_size;
+
+  for (i = 0; i < nparts; i++) {
+    offset[i] = pos;
+    pos += (size[i] + psize - 1) / psize * psize;
+  }
+}
+
+
+
+static int check_boot_img_header(t_abootimg* img)
+{
+  if (strncmp((char*)(img->header.magic), BOOT_MAGIC, BOOT_MAGIC_SIZE)) {
+    warn(img, "%s: no Android Magic Value\n", img->fname);
+    return 1;
+  }
+
+  if (!(img->header.kernel_size)) {
+    warn(img, "%s: kernel size is null\n", img->fname);
+    return 1;
+  }
+
+  if (!(img->header.ramdisk_size)) {
+    warn(img, "%s: ramdisk size is null\n", img->fname);
+    return 1;
+  }
+
+  unsigned page_size = img->header.page_size;
+  if (!page_size) {
+    warn(img, "%s: Image page size is null\n", img->fname);
+    return 1;
+  }
+
+  if (!(img->header.dt_size)) {
+    warn(img, "%s: device tree is null\n", img->fname);
+  }
+
+//  if (!(img->header.unused)) {
+//    fprintf(stderr, "%s: unused is null\n", img->fname);
+//  }
+
+  if (!(img->header.name)) {
+    warn(img, "%s: name is null\n", img->fname);
+  }
+
+  if (!(img->header.cmdline)) {
+    warn(img, "%s: cmdline is null\n", img->fname);
+  }
+
+  unsigned n = (img->header.kernel_size + page_size - 1) / page_size;
+  unsigned m = (img->header.ramdisk_size + page_size - 1) / page_size;
+  unsigned o = (img->header.second_size + page_size - 1) / page_size;
+  unsigned p = (img->header.dt_size + page_size - 1) / page_size;
+
+  unsigned total_size = (1+n+m+o+p)*page_size;
+
+  if (total_size > img->size) {
+    warn(img, "%s: sizes mismatches in boot image\n", img->fname);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+
+static void check_if_block_device(t_abootimg* img)
+{
+  struct stat st;
+
+  int fd = open_file(img, img->fname, O_RDONLY | O_NONBLOCK, 0);
+  if (fd == -1) {
+    if (errno != ENOENT)
+      abort_perror(img->fname);
+    return;
+  }
+  if (fstat(fd, &st)) {
+    close(fd);
+    abort_perror(img->fname);
+  }
+
+#ifdef HAS_BLKID
+  if (S_ISBLK(st.st_mode)) {
+    img->is_blkdev = 1;
+
+    // probe the device itself: unlike the blkid cache, a probe is not
+    // shared between threads
+    char type[64] = "";
+    const char* value;
+    blkid_probe pr = blkid_new_probe();
+    if (pr && !blkid_probe_set_device(pr, fd, 0, 0) && !blkid_do_safeprobe(pr) &&
+        !blkid_probe_lookup_value(pr, "TYPE", &value, NULL))
+      snprintf(type, sizeof(type), "%s", value);
+    if (pr)
+      blkid_free_probe(pr);
+
+    unsigned long long bsize = 0;
+    int failed = blkgetsize(fd, &bsize);
+    close(fd);
+
+    if (type[0])
+      abort_printf("%s: refuse to write on a valid partition type (%s)\n", img->fname, type);
+    if (failed)
+      abort_perror(img->fname);
+    img->size = bsize;
+    return;
+  }
+#endif
+
+  close(fd);
+}
+
+
+
+static void open_bootimg(t_abootimg* img, char* mode)
+{
+  img->stream = fopen_file(img, img->fname, mode);
+  if (!img->stream)
+    abort_perror(img->fname);
+}
+
+
+
+/*
+ * The algorithm of an id is told by its length, without reading the
+ * image: a SHA-1 id leaves the last 12 bytes null, a SHA-256 id fills
+ * the 32 bytes.
+ */
+static int header_id_algo(const boot_img_hdr* h)
+{
+  return h->id[5] || h->id[6] || h->id[7] ? id_sha256 : id_sha1;
+}
+
+
+static void read_header(t_abootimg* img)
+{
+  size_t rb = fread(&img->header, sizeof(boot_img_hdr), 1, img->stream);
+  if ((rb!=1) || ferror(img->stream))
+    abort_perror(img->fname);
+  else if (feof(img->stream))
+    abort_printf("%s: cannot read image header\n", img->fname);
+
+  struct stat s;
+  int fd = fileno(img->stream);
+  if (fstat(fd, &s))
+    abort_perror(img->fname);
+
+  if (S_ISBLK(s.st_mode)) {
+    unsigned long long bsize = 0;
+
+    if (blkgetsize(fd, &bsize))
+      abort_perror(img->fname);
+    img->size = bsize;
+    img->is_blkdev = 1;
+  }
+  else {
+    img->size = s.st_size;
+    img->is_blkdev = 0;
+  }
+
+  if (check_boot_img_header(img))
+    abort_printf("%s: not a valid Android Boot Image.\n", img->fname);
+
+  img->orig_header = img->header;
+  img->orig_size = img->size;
+
+  // an updated image keeps its id algorithm, unless idalgo is given
+  if (!img->id_algo_set)
+    img->id_algo = header_id_algo(&img->header);
+}
+
+
+
+static void update_header_entry(t_abootimg* img, char* cmd)
+{
+  char *p;
+  char *token;
+  char *endtoken;
+  char *value;
+
+  p = strchr(cmd, '\n');
+  if (p)
+    *p  = '\0';
+
+  p = cmd;
+  p += strspn(p, " \t");
+  token = p;
+  
+  p += strcspn(p, " =\t");
+  endtoken = p;
+  p += strspn(p, " \t");
+
+  if (*p++ != '=')
+    goto err;
+
+  p += strspn(p, " \t");
+  value = p;
+
+  *endtoken = '\0';
+
+  unsigned valuenum = strtoul(value, NULL, 0);
+  
+  if (!strcmp(token, "cmdline")) {
+    unsigned len = strlen(value);
+    if (len >= BOOT_ARGS_SIZE) 
+      abort_printf("cmdline length (%d) is too long (max %d)", len, BOOT_ARGS_SIZE-1);
+    memset(img->header.cmdline, 0, BOOT_ARGS_SIZE);
+    strcpy((char*)(img->header.cmdline), value);
+  }
+  else if (!strncmp(token, "name", 4)) {
+    strncpy((char*)(img->header.name), value, BOOT_NAME_SIZE);
+    img->header.name[BOOT_NAME_SIZE-1] = '\0';
+  }
+  else if (!strncmp(token, "bootsize", 8)) {
+    if (img->is_blkdev && (img->size != valuenum))
+      abort_printf("%s: cannot change Boot Image size for a block device\n", img->fname);
+    img->size = valuenum;
+  }
+  else if (!strncmp(token, "pagesize", 8)) {
+    img->header.page_size = valuenum;
+  }
+  else if (!strncmp(token, "kerneladdr", 10)) {
+    img->header.kernel_addr = valuenum;
+  }
+  else if (!strncmp(token, "ramdiskaddr", 11)) {
+    img->header.ramdisk_addr = valuenum;
+  }
+  else if (!strncmp(token, "secondaddr", 10)) {
+    img->header.second_addr = valuenum;
+  }
+  else if (!strncmp(token, "tagsaddr", 8)) {
+    img->header.tags_addr = valuenum;
+  }
+  else if (!strncmp(token, "devtree", 7)) {
+    img->header.dt_size = valuenum;
+  }
+  else if (!strcmp(token, "idalgo")) {
+    if (!strcmp(value, "sha1"))
+      img->id_algo = id_sha1;
+    else if (!strcmp(value, "sha256"))
+      img->id_algo = id_sha256;
+    else
+      abort_printf("%s: unknown id algorithm (sha1 or sha256)", value);
+    img->id_algo_set = 1;
+  }
+  else
+    goto err;
+  return;
+
+err:
+  abort_printf("%s: bad config entry\n", token);
+}
+
+
+/*
+ * Applies the "key = value" lines of f, which is closed.
+ */
+static void read_config(t_abootimg* img, FILE* f, const char* what)
+{
+  int hf = hold_file(f);
+  int hl = hold_mem(NULL);
+  char* line = NULL;
+  size_t len = 0;
+
+  while (getline(&line, &len, f) != -1) {
+    trap->held[hl].p = line;  /* moved by getline */
+    update_header_entry(img, line);
+  }
+  trap->held[hl].p = line;
+  if (ferror(f))
+    abort_perror((char*)what);
+  let_go(hl);
+  let_go(hf);
+  free(line);
+  fclose(f);
+}
+
+static void update_header(t_abootimg* img)
+{
+  if (img->config_fname) {
+    FILE* config_file = fopen_file(img, img->config_fname, "r");
+    if (!config_file)
+      abort_perror(img->config_fname);
+
+    report(img, "reading config file %s\n", img->config_fname);
+    read_config(img, config_file, img->config_fname);
+  }
+
+  unsigned len = strlen(img->config_args);
+  if (len) {
+    FILE* config_file = fmemopen(img->config_args, len, "r");
+    if  (!config_file)
+      abort_perror("-c args");
+
+    report(img, "reading config args\n");
+    read_config(img, config_file, "-c args");
+  }
+}
+
+
+
+/*
+ * Packs the tree under dirfd as a ramdisk compressed in format, to out_fd.
+ * Closes dirfd.
+ */
+static void pack_tree(t_abootimg* img, int dirfd, const char* dirname, int out_fd, int format)
+{
+  struct timespec t0, t1;
+  t_initrd rd;
+
+  if (!fmt_supported(format)) {
+    close(dirfd);
+    abort_printf("%s: %s compression is not built in\n", dirname, fmt_name(format));
+  }
+
+  initrd_init(&rd);
+  rd.format = format;
+  rd.threads = img->threads;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  int failed = initrd_pack(&rd, dirfd, out_fd);
+  int err = errno;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  close(dirfd);
+
+  if (failed) {
+    char path[PATH_MAX + 256];
+    snprintf(path, sizeof(path), "%s%s%s", dirname, rd.path[0] ? "/" : "", rd.path);
+    errno = err;
+    abort_perror(path);
+  }
+
+  img->bytes_read += rd.bytes_read;
+  img->bytes_written += rd.size;
+  report(img, "  %llu entries, %llu bytes of cpio, %llu bytes of %s (%.1f ms)\n",
+         rd.entries, rd.cpio_size, rd.size, fmt_name(format),
+         ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9) * 1000);
+}
+
+/*
+ * Packs a ramdisk tree in an anonymous file. Returns its descriptor.
+ */
+static int pack_in_memory(t_abootimg* img, int dirfd, const char* dirname, int format)
+{
+#ifdef MFD_CLOEXEC
+  int fd = memfd_create("initrd", MFD_CLOEXEC);
+#else
+  FILE* f = tmpfile();
+  int fd = f ? dup(fileno(f)) : -1;
+  if (f)
+    fclose(f);
+#endif
+  if (fd == -1) {
+    close(dirfd);
+    abort_perror("initrd");
+  }
+
+  report(img, "packing ramdisk from %s\n", dirname);
+  img->src[part_ramdisk].fd = fd;  /* closed with the sources on errors */
+  pack_tree(img, dirfd, dirname, fd, format);
+  return fd;
+}
+
+/*
+ * --pack-initrd: packs the ramdisk tree to the initrd file, which is not
+ * overwritten unless forced.
+ */
+static void pack_initrd(t_abootimg* img)
+{
+  int format = img->format >= 0 ? img->format : fmt_gzip;
+  if (!fmt_supported(format))
+    abort_printf("%s compression is not built in\n", fmt_name(format));
+
+  int dirfd = open_file(img, img->ramdisk_fname, O_RDONLY | O_DIRECTORY, 0);
+  if (dirfd == -1)
+    abort_perror(img->ramdisk_fname);
+
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | (img->force ? 0 : O_EXCL);
+  int fd = open_file(img, img->fname, flags, 0666);
+  if (fd == -1) {
+    close(dirfd);
+    abort_perror(img->fname);
+  }
+
+  report(img, "packing %s in %s\n", img->ramdisk_fname, img->fname);
+  img->src[part_ramdisk].fd = fd;  /* closed with the sources on errors */
+  pack_tree(img, dirfd, img->ramdisk_fname, fd, format);
+  img->src[part_ramdisk].fd = -1;
+  if (close(fd))
+    abort_perror(img->fname);
+}
+
+
+
+/* --unpack-initrd -l: one line per entry, as ls -l prints it */
+static void list_entry(void* ctx, const char* name, unsigned mode,
+                       unsigned long long size, const char* target)
+{
+  static const char types[] = "?pc?d?b?-?l?s???";
+  char perms[11];
+  int i;
+
+  perms[0] = types[(mode >> 12) & 15];
+  for (i = 0; i < 9; i++)
+    perms[1 + i] = mode & (0400 >> i) ? "rwxrwxrwx"[i] : '-';
+  perms[10] = 0;
+  if (mode & S_ISUID)
+    perms[3] = mode & S_IXUSR ? 's' : 'S';
+  if (mode & S_ISGID)
+    perms[6] = mode & S_IXGRP ? 's' : 'S';
+  if (mode & S_ISVTX)
+    perms[9] = mode & S_IXOTH ? 't' : 'T';
+
+  report(ctx, "%s %10llu %s%s%s\n", perms, size, name,
+         target ? " -> " : "", target ? target : "");
+}
+
+/*
+ * Creates the ramdisk directory, which must not exist yet. Returns its
+ * descriptor.
+ */
+static int make_ramdisk_dir(t_abootimg* img)
+{
+  char parent[PATH_MAX];
+  size_t len = strlen(img->ramdisk_fname);
+
+  if (len >= sizeof(parent))
+    abort_printf("%s: file name too long\n", img->ramdisk_fname);
+  memcpy(parent, img->ramdisk_fname, len + 1);
+  while ((len > 1) && (parent[len - 1] == '/'))
+    parent[--len] = 0;
+
+  const char* dir = ".";
+  const char* base = parent;
+  char* slash = strrchr(parent, '/');
+  if (slash) {
+    *slash = 0;
+    dir = slash == parent ? "/" : parent;
+    base = slash + 1;
+  }
+
+  int pfd = open_file(img, dir, O_RDONLY | O_DIRECTORY, 0);
+  if (pfd == -1)
+    abort_perror(img->ramdisk_fname);
+  int dirfd = -1;
+  if (!mkdirat(pfd, base, 0755))
+    dirfd = openat(pfd, base, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  int err = errno;
+  close(pfd);
+  if (dirfd == -1) {
+    errno = err;
+    abort_perror(img->ramdisk_fname);
+  }
+  return dirfd;
+}
+
+/*
+ * --unpack-initrd: unpacks (or lists) the ramdisk of a boot image, read
+ * in place, or a ramdisk archive file.
+ */
+static void unpack_initrd(t_abootimg* img)
+{
+  struct timespec t0, t1;
+  unsigned offset[nparts], size[nparts];
+  char magic[BOOT_MAGIC_SIZE];
+  off_t start = 0;
+  unsigned long long len;
+  t_initrd rd;
+
+  open_bootimg(img, "r");
+  if ((fread(magic, sizeof(magic), 1, img->stream) == 1) &&
+      !memcmp(magic, BOOT_MAGIC, BOOT_MAGIC_SIZE)) {
+    rewind(img->stream);
+    read_header(img);
+    get_layout(&img->header, offset, size);
+    start = offset[part_ramdisk];
+    len = size[part_ramdisk];
+  }
+  else {
+    struct stat st;
+    if (ferror(img->stream) || fstat(fileno(img->stream), &st))
+      abort_perror(img->fname);
+    len = st.st_size;
+  }
+
+  // nothing is created for an archive which cannot be read
+  initrd_init(&rd);
+  if (initrd_probe(&rd, fileno(img->stream), start, len)) {
+    if (rd.error)
+      abort_printf("%s: %s\n", img->fname, rd.error);
+    abort_perror(img->fname);
+  }
+
+  int dirfd = -1;
+  if (!img->list) {
+    dirfd = make_ramdisk_dir(img);
+    report(img, "unpacking %s in %s\n", img->fname, img->ramdisk_fname);
+  }
+
+  rd.list = img->list ? list_entry : NULL;
+  rd.ctx = img;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  int failed = initrd_unpack(&rd, fileno(img->stream), start, len, dirfd);
+  int err = errno;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (dirfd != -1)
+    close(dirfd);
+  img->bytes_read += rd.bytes_read;
+  img->bytes_written += rd.bytes_written;
+
+  if (failed && rd.error)
+    abort_printf("%s: %s%s%s\n", img->fname, rd.error,
+                 rd.path[0] ? " at " : "", rd.path);
+  if (failed) {
+    char path[PATH_MAX + 256];
+    snprintf(path, sizeof(path), "%s%s%s", img->ramdisk_fname, rd.path[0] ? "/" : "", rd.path);
+    errno = err;
+    abort_perror(path);
+  }
+
+  if (img->list)
+    return;
+  if (rd.skipped)
+    warn(img, "%s: %llu device nodes not created (not root)\n", img->ramdisk_fname, rd.skipped);
+  report(img, "  %llu entries, %llu bytes of cpio, from %llu bytes of %s (%.1f ms)\n",
+         rd.entries, rd.cpio_size, rd.size, fmt_name(rd.format),
+         ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9) * 1000);
+}
+
+
+
+/*
+ * Compression of a ramdisk packed for the image: --compress, or the one of
+ * the ramdisk it replaces, gzip otherwise.
+ */
+static int ramdisk_format(t_abootimg* img, unsigned offset, unsigned size, int dirfd)
+{
+  unsigned char magic[16];
+
+  if (img->format >= 0)
+    return img->format;
+  if (!img->stream || !size)
+    return fmt_gzip;
+
+  ssize_t rb = pread(fileno(img->stream), magic, size < sizeof(magic) ? size : sizeof(magic), offset);
+  if (rb < 0) {
+    close(dirfd);
+    abort_perror(img->fname);
+  }
+  int format = fmt_detect(magic, rb);
+  if (format < 0) {
+    warn(img, "%s: unknown ramdisk compression, using gzip\n", img->fname);
+    return fmt_gzip;
+  }
+  report(img, "keeping the %s compression of the ramdisk\n", fmt_name(format));
+  return format;
+}
+
+
+
+/*
+ * Opens the replacement components. Components which are not replaced
+ * are read from the original image, at their original offset, when the
+ * image is written.
+ */
+static void update_images(t_abootimg *img)
+{
+  static const char* names[nparts] = { "kernel", "ramdisk", "second stage", "device tree" };
+  char* fname[nparts] = { img->kernel_fname, img->ramdisk_fname, img->second_fname, img->devtree_fname };
+  unsigned* hsize[nparts] = { &img->header.kernel_size, &img->header.ramdisk_size,
+                              &img->header.second_size, &img->header.dt_size };
+  unsigned old_offset[nparts], old_size[nparts];
+  unsigned offset[nparts], size[nparts];
+  int i;
+
+  if (!img->header.page_size)
+    abort_printf("%s: Image page size is null\n", img->fname);
+
+  if (img->orig_header.page_size)
+    get_layout(&img->orig_header, old_offset, old_size);
+  else
+    memset(old_offset, 0, sizeof(old_offset));
+
+  for (i = 0; i < nparts; i++) {
+    t_source* src = &img->src[i];
+
+    if (fname[i]) {
+      report(img, "reading %s from %s\n", names[i], fname[i]);
+      src->fd = open_file(img, fname[i], O_RDONLY, 0);
+      if (src->fd == -1)
+        abort_perror(fname[i]);
+      struct stat st;
+      if (fstat(src->fd, &st))
+        abort_perror(fname[i]);
+      if (S_ISDIR(st.st_mode) && (i == part_ramdisk)) {
+        // a ramdisk tree, packed in memory; pack_in_memory owns dirfd
+        int dirfd = src->fd;
+        src->fd = -1;
+        int format = ramdisk_format(img, old_offset[i], old_size[i], dirfd);
+        src->fd = pack_in_memory(img, dirfd, fname[i], format);
+        if (fstat(src->fd, &st))
+          abort_perror(fname[i]);
+      }
+      else if (S_ISDIR(st.st_mode)) {
+        errno = EISDIR;
+        abort_perror(fname[i]);
+      }
+      *hsize[i] = st.st_size;
+      src->fname = fname[i];
+      src->offset = 0;
+    }
+    else {
+      src->fd = img->stream ? fileno(img->stream) : -1;
+      src->fname = img->fname;
+      src->offset = old_offset[i];
+    }
+  }
+
+  get_layout(&img->header, offset, size);
+  unsigned total_size = offset[part_devtree] +
+    (size[part_devtree] + img->header.page_size - 1) / img->header.page_size * img->header.page_size;
+
+  if (!img->size)
+    img->size = total_size;
+  else if (total_size > img->size)
+    abort_printf("%s: updated is too big for the Boot Image (%u vs %u bytes)\n", img->fname, total_size, img->size);
+}
+
+
+
+/*
+ * Maps [offset, offset+size) of fd read-only, for sequential
+ * access. Returns -1 when the image cannot be mapped.
+ */
+static int open_view(int fd, unsigned offset, unsigned size, t_view* v)
+{
+  long pagesz = sysconf(_SC_PAGESIZE);
+  off_t start = offset & ~(off_t)(pagesz - 1);
+
+  memset(v, 0, sizeof(*v));
+  if (!size)
+    return 0;
+
+  v->maplen = offset - start + size;
+  v->map = mmap(NULL, v->maplen, PROT_READ, MAP_SHARED, fd, start);
+  if (v->map == MAP_FAILED) {
+    v->map = NULL;
+    return -1;
+  }
+  madvise(v->map, v->maplen, MADV_SEQUENTIAL);
+
+  v->data = v->map + (offset - start);
+  v->size = size;
+  return 0;
+}
+
+/*
+ * Gives back the pages of the first done bytes of the view, so the
+ * resident set does not grow with the size of the range.
+ */
+static void release_view(t_view* v, size_t done)
+{
+  long pagesz = sysconf(_SC_PAGESIZE);
+  size_t upto = (v->data - v->map + done) & ~(size_t)(pagesz - 1);
+
+  if (upto > v->dropped) {
+    madvise(v->map + v->dropped, upto - v->dropped, MADV_DONTNEED);
+    v->dropped = upto;
+  }
+}
+
+static void close_view(t_view* v)
+{
+  if (v->map)
+    munmap(v->map, v->maplen);
+  v->map = NULL;
+}
+
+
+
+/*
+ * Calls fn on consecutive windows of [offset, offset+size) of the image,
+ * through a mapping when possible, through a bounded buffer otherwise.
+ */
+static void for_each_window(t_abootimg* img, unsigned offset, unsigned size,
+                     void (*fn)(const char* data, size_t len, void* arg), void* arg)
+{
+  t_view v;
+  size_t done, len;
+
+  if (!open_view(fileno(img->stream), offset, size, &v)) {
+    int h = hold_map(v.map, v.maplen);
+    for (done = 0; done < size; done += len) {
+      len = size - done > IO_WINDOW ? IO_WINDOW : size - done;
+      img->bytes_read += len;
+      fn(v.data + done, len, arg);
+      release_view(&v, done + len);
+    }
+    let_go(h);
+    close_view(&v);
+    return;
+  }
+
+  char* buf = malloc(IO_WINDOW);
+  if (!buf)
+    abort_perror("");
+  int h = hold_mem(buf);
+  for (done = 0; done < size; done += len) {
+    len = size - done > IO_WINDOW ? IO_WINDOW : size - done;
+    ssize_t rb = pread(fileno(img->stream), buf, len, offset + done);
+    if (rb < 0)
+      abort_perror(img->fname);
+    if (rb == 0)
+      abort_printf("%s: unexpected end of image\n", img->fname);
+    len = rb;
+    img->bytes_read += len;
+    fn(buf, len, arg);
+  }
+  let_go(h);
+  free(buf);
+}
+
+
+
+/*
+ * Window callback feeding n hashes at once.
+ */
+typedef struct
+{
+  HASH_CTX*    ctx;
+  int          n;
+} t_hashes;
+
+static void hash_window(const char* data, size_t len, void* arg)
+{
+  t_hashes* h = arg;
+  int i;
+
+  for (i = 0; i < h->n; i++)
+    HASH_update(&h->ctx[i], data, len);
+}
+
+/*
+ * 64-bit fingerprint used to recognize an unchanged kernel. Four
+ * independent multiply/xorshift lanes over 8-byte words; much cheaper
+ * than SHA, not meant to resist deliberate collisions.
+ */
+static uint64_t fingerprint(const void* data, unsigned len)
+{
+  const unsigned char* p = data;
+  const uint64_t mul = 0x9fb21c651e98df25ULL;
+  uint64_t h[4] = { len, 0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL };
+  uint64_t v;
+  int i;
+
+  for (; len >= 32; len -= 32, p += 32) {
+    for (i = 0; i < 4; i++) {
+      memcpy(&v, p + 8*i, 8);
+      h[i] = (h[i] ^ v) * mul;
+      h[i] ^= h[i] >> 29;
+    }
+  }
+  for (i = 0; len; len--, p++, i = (i+1) & 3)
+    h[i] = (h[i] ^ *p) * mul;
+
+  v = h[0];
+  for (i = 1; i < 4; i++) {
+    v = (v ^ h[i]) * mul;
+    v ^= v >> 32;
+  }
+  return v;
+}
+
+
+
+/*
+ * Restores the SHA midstate after the kernel from the id cache when the
+ * cached kernel is the same. Returns 1 if ctx was restored.
+ */
+static int load_id_cache(t_abootimg* img, uint64_t fp, HASH_CTX* ctx)
+{
+  t_idcache c;
+
+  FILE* f = fopen_file(img, img->idcache_fname, "r");
+  if (!f)
+    return 0;
+  size_t rb = fread(&c, sizeof(c), 1, f);
+  fclose(f);
+
+  if ((rb != 1) || memcmp(c.magic, IDCACHE_MAGIC, sizeof(c.magic)) ||
+      (c.fingerprint != fp) || (c.kernel_size != img->header.kernel_size) ||
+      (c.id_algo != img->id_algo))
+    return 0;
+
+  ctx->count = c.count;
+  memcpy(ctx->buf, c.buf, sizeof(ctx->buf));
+  memcpy(ctx->state, c.state, sizeof(ctx->state));
+  return 1;
+}
+
+
+
+static void save_id_cache(t_abootimg* img, uint64_t fp, const HASH_CTX* midstate, int hit)
+{
+  t_idcache c;
+
+  memset(&c, 0, sizeof(c));
+  memcpy(c.magic, IDCACHE_MAGIC, sizeof(c.magic));
+  c.fingerprint = fp;
+  c.kernel_size = img->header.kernel_size;
+  c.id_algo = img->id_algo;
+  c.hit = hit;
+  memcpy(c.id, img->header.id, sizeof(c.id));
+  c.count = midstate->count;
+  memcpy(c.buf, midstate->buf, sizeof(c.buf));
+  memcpy(c.state, midstate->state, sizeof(c.state));
+
+  // the cache is only an optimization, failing to write it is not fatal
+  FILE* f = fopen_file(img, img->idcache_fname, "w");
+  if (!f || (fwrite(&c, sizeof(c), 1, f) != 1))
+    warn(img, "%s: cannot write id cache\n", img->idcache_fname);
+  if (f)
+    fclose(f);
+}
+
+
+
+/*
+ * The id is the hash of each component followed by its size, as done by
+ * mkbootimg. The device tree is only hashed when present.
+ */
+static void init_id_hash(HASH_CTX* ctx, int algo)
+{
+  if (algo == id_sha256)
+    SHA256_init(ctx);
+  else
+    SHA_init(ctx);
+}
+
+static void final_id_hash(HASH_CTX* ctx, unsigned* id)
+{
+  const uint8_t* digest = HASH_final(ctx);
+  unsigned size = HASH_size(ctx);
+
+  memset(id, 0, 8 * sizeof(unsigned));
+  memcpy(id, digest, size > 8 * sizeof(unsigned) ? 8 * sizeof(unsigned) : size);
+}
+
+static void sha1_id(const uint8_t* digest, unsigned* id)
+{
+  memset(id, 0, 8 * sizeof(unsigned));
+  memcpy(id, digest, SHA_DIGEST_SIZE);
+}
+
+
+
+/*
+ * Shares the whole filesystem blocks of [src_off, src_off+len) of src_fd
+ * at dst_off of dst_fd (btrfs, XFS, ...) instead of copying them. Both
+ * offsets have to be block aligned. Returns the number of bytes shared;
+ * the caller copies the rest, including the partial last block.
+ */
+static size_t reflink_range(int src_fd, off_t src_off, int dst_fd, off_t dst_off, size_t len)
+{
+#ifdef FICLONERANGE
+  struct stat src_st, dst_st;
+  struct file_clone_range range;
+
+  if (fstat(src_fd, &src_st) || fstat(dst_fd, &dst_st))
+    return 0;
+  if (!S_ISREG(src_st.st_mode) || !S_ISREG(dst_st.st_mode))
+    return 0;
+
+  off_t bsize = src_st.st_blksize > dst_st.st_blksize ? src_st.st_blksize : dst_st.st_blksize;
+  if ((bsize <= 0) || (src_off % bsize) || (dst_off % bsize) || (len < bsize))
+    return 0;
+
+  range.src_fd = src_fd;
+  range.src_offset = src_off;
+  range.src_length = len / bsize * bsize;
+  range.dest_offset = dst_off;
+  if (ioctl(dst_fd, FICLONERANGE, &range))
+    return 0;  /* EOPNOTSUPP, EXDEV, EINVAL... */
+
+  return range.src_length;
+#else
+  return 0;
+#endif
+}
+
+
+
+/*
+ * Writes an iovec list at offset in the image (opened as fd), in as few
+ * pwritev calls as the kernel allows. The calls and the time spent in them are
+ * accounted in img.
+ */
+static void write_iov(t_abootimg* img, int fd, struct iovec* iov, int n, off_t offset)
+{
+  struct timespec t0, t1;
+
+  while (n) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ssize_t wb = pwritev(fd, iov, n, offset);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    img->write_calls++;
+    img->write_time += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if (wb < 0)
+      abort_perror(img->fname);
+    if (wb == 0)
+      abort_printf("%s: short write\n", img->fname);
+
+    img->bytes_written += wb;
+    offset += wb;
+    while (n && (wb >= iov->iov_len)) {
+      wb -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n) {
+      iov->iov_base = (char*)iov->iov_base + wb;
+      iov->iov_len -= wb;
+    }
+  }
+}
+
+
+
+/*
+ * Compares len bytes at offset of the image with what it currently holds,
+ * refilling w->cmp from fd as needed. Bytes past the end of the image
+ * always differ.
+ */
+static int same_as_image(t_abootimg* img, t_writer* w, int fd, const char* data, size_t len, off_t offset)
+{
+  while (len) {
+    if ((offset < w->cmp_offset) || (offset >= w->cmp_offset + IO_WINDOW)) {
+      w->cmp_offset = offset / w->unit * w->unit;
+      ssize_t rb = pread(fd, w->cmp, IO_WINDOW, w->cmp_offset);
+      if (rb < 0)
+        abort_perror(img->fname);
+      w->cmp_len = rb;
+      img->bytes_read += rb;
+    }
+
+    size_t at = offset - w->cmp_offset;
+    size_t n = IO_WINDOW - at < len ? IO_WINDOW - at : len;
+    if ((at + n > w->cmp_len) || memcmp(w->cmp + at, data, n))
+      return 0;
+    data += n;
+    offset += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/*
+ * --diff-write counterpart of write_iov: the iovec list is cut at each
+ * w->unit boundary of the image, and only the runs of units which differ
+ * from the current content are written.
+ */
+static void write_diff(t_abootimg* img, t_writer* w, int fd, struct iovec* iov, int n, off_t offset)
+{
+  struct iovec run[WRITE_IOVS];
+  int nrun = 0;
+  off_t run_offset = 0;
+  size_t at = 0;  /* in iov[0] */
+
+  while (n) {
+    // one unit, or what is left of it, possibly over several iovecs
+    off_t start = offset;
+    off_t end = (offset / w->unit + 1) * w->unit;
+    struct iovec piece[WRITE_IOVS];
+    int npiece = 0;
+    int same = 1;
+
+    while (n && (offset < end)) {
+      size_t len = iov->iov_len - at;
+      if (len > end - offset)
+        len = end - offset;
+      piece[npiece].iov_base = (char*)iov->iov_base + at;
+      piece[npiece].iov_len = len;
+      npiece++;
+      same = same && same_as_image(img, w, fd, (char*)iov->iov_base + at, len, offset);
+      offset += len;
+      at += len;
+      if (at == iov->iov_len) {
+        iov++;
+        n--;
+        at = 0;
+      }
+      if (npiece == WRITE_IOVS)
+        break;
+    }
+
+    if (same)
+      img->pages_same++;
+    else
+      img->pages_diff++;
+
+    if (nrun && (same || (nrun + npiece > WRITE_IOVS))) {
+      write_iov(img, fd, run, nrun, run_offset);
+      nrun = 0;
+    }
+    if (!same) {
+      if (!nrun)
+        run_offset = start;
+      memcpy(run + nrun, piece, npiece * sizeof(*piece));
+      nrun += npiece;
+    }
+  }
+
+  if (nrun)
+    write_iov(img, fd, run, nrun, run_offset);
+}
+
+/*
+ * Writes through write_diff with --diff-write, write_iov otherwise.
+ */
+static void submit_iov(t_abootimg* img, t_writer* w, int fd, struct iovec* iov, int n, off_t offset)
+{
+  if (img->diff_write)
+    write_diff(img, w, fd, iov, n, offset);
+  else
+    write_iov(img, fd, iov, n, offset);
+}
+
+
+
+/*
+ * Reads the aligned block at offset into buf, zeros past the end.
+ */
+static void read_block(t_abootimg* img, t_writer* w, char* buf, off_t offset)
+{
+  ssize_t rb = pread(w->direct_fd, buf, w->align, offset);
+  if (rb < 0)
+    abort_perror(img->fname);
+  memset(buf + rb, 0, w->align - rb);
+}
+
+/*
+ * Writes the whole aligned blocks of the stage. Unless all is set, the
+ * last partial block is kept at the start of the stage, to be completed
+ * by the next writes; otherwise it is completed with what the image
+ * holds after it.
+ */
+static void flush_stage(t_abootimg* img, t_writer* w, int all)
+{
+  size_t len = w->len / w->align * w->align;
+  size_t rest = w->len - len;
+
+  if (all && rest) {
+    read_block(img, w, w->block, w->offset + len);
+    memcpy(w->stage + w->len, w->block + rest, w->align - rest);
+    len += w->align;
+    rest = 0;
+  }
+
+  if (len) {
+    struct iovec iov = { w->stage, len };
+    submit_iov(img, w, w->direct_fd, &iov, 1, w->offset);
+  }
+
+  if (rest)
+    memcpy(w->stage, w->stage + len, rest);
+  w->offset += len;
+  w->len = rest;
+  w->n = (rest != 0);
+}
+
+static void flush_writer(t_abootimg* img, t_writer* w)
+{
+  if (w->direct_fd != -1) {
+    if (w->n)
+      flush_stage(img, w, 1);
+  }
+  else if (w->n)
+    submit_iov(img, w, fileno(img->stream), w->iov, w->n, w->offset);
+  w->n = 0;
+  w->len = 0;
+  w->used = 0;
+}
+
+/*
+ * O_DIRECT counterpart of queue_write: the bytes are copied to the
+ * aligned stage, starting with what the image holds before offset in
+ * its first block.
+ */
+static void queue_direct(t_abootimg* img, t_writer* w, const char* base, size_t len, off_t offset)
+{
+  if (w->n && (offset != w->offset + w->len))
+    flush_writer(img, w);
+
+  if (!w->n) {
+    w->offset = offset / w->align * w->align;
+    w->len = offset - w->offset;
+    if (w->len)
+      read_block(img, w, w->stage, w->offset);
+    w->n = 1;
+  }
+
+  while (len) {
+    size_t room = IO_WINDOW - w->len;
+    size_t n = len > room ? room : len;
+    memcpy(w->stage + w->len, base, n);
+    w->len += n;
+    w->n = 1;
+    base += n;
+    len -= n;
+    if (w->len == IO_WINDOW)
+      flush_stage(img, w, 0);
+  }
+}
+
+/*
+ * Digest of a page for --verify, from its SHA-1.
+ */
+static uint64_t digest_sum(const uint8_t* digest)
+{
+  uint64_t sum;
+
+  memcpy(&sum, digest, sizeof(sum));
+  return sum | 1;  /* 0 is for unknown pages */
+}
+
+static uint64_t page_sum(HASH_CTX* ctx)
+{
+  return digest_sum(HASH_final(ctx));
+}
+
+/*
+ * Feeds bytes queued for writing to the digests of their pages. A page is
+ * only known if it is queued from its first to its last byte in order.
+ */
+static void sum_pages(t_abootimg* img, t_writer* w, const char* base, size_t len, off_t offset)
+{
+  unsigned psize = img->header.page_size;
+
+  while (len) {
+    off_t page_end = (offset / psize + 1) * psize;
+    size_t n = page_end - offset < len ? page_end - offset : len;
+
+    if (offset != w->page_at) {
+      w->page_at = -1;
+      if (!(offset % psize)) {
+        SHA_init(&w->page_ctx);
+        w->page_at = offset;
+      }
+    }
+    if (w->page_at != -1) {
+      HASH_update(&w->page_ctx, base, n);
+      w->page_at += n;
+      if ((w->page_at == page_end) && (offset / psize < w->nsums)) {
+        w->sums[offset / psize] = page_sum(&w->page_ctx);
+        w->page_at = -1;
+      }
+    }
+    base += n;
+    offset += n;
+    len -= n;
+  }
+}
+
+
+
+/*
+ * Queues len bytes at base to be written at offset. Anything which is not
+ * right after the pending bytes is written first.
+ */
+static void queue_write(t_abootimg* img, t_writer* w, const char* base, size_t len, off_t offset)
+{
+  if (w->sums)
+    sum_pages(img, w, base, len, offset);
+
+  if (w->direct_fd != -1) {
+    queue_direct(img, w, base, len, offset);
+    return;
+  }
+
+  if (w->n && ((w->n == WRITE_IOVS) || (offset != w->offset + w->len)))
+    flush_writer(img, w);
+  if (!w->n)
+    w->offset = offset;
+
+  w->iov[w->n].iov_base = (char*)base;
+  w->iov[w->n].iov_len = len;
+  w->n++;
+  w->len += len;
+}
+
+
+
+/*
+ * Zeroes [offset, offset+len) of the image. On files, the whole
+ * filesystem blocks of the range are punched out as holes and only its
+ * edges are written.
+ */
+static void zero_range(t_abootimg* img, t_writer* w, off_t offset, size_t len)
+{
+  off_t end = offset + len;
+  size_t n;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if (w->hole_size) {
+    off_t bs = w->hole_size;
+    off_t hole_start = (offset + bs - 1) / bs * bs;
+    off_t hole_end = end / bs * bs;
+
+    if (hole_end > hole_start) {
+      if (!fallocate(fileno(img->stream), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     hole_start, hole_end - hole_start)) {
+        img->bytes_holes += hole_end - hole_start;
+        zero_range(img, w, hole_end, end - hole_end);
+        end = hole_start;
+      }
+      else
+        w->hole_size = 0;  /* EOPNOTSUPP... */
+    }
+  }
+#endif
+
+  for (; offset < end; offset += n) {
+    n = end - offset > w->zero_len ? w->zero_len : end - offset;
+    queue_write(img, w, w->zero, n, offset);
+  }
+}
+
+
+
+/*
+ * Clears the space between the end of the image and the end of a block
+ * device as asked with --tail. Files are simply left with a hole.
+ */
+static void clear_tail(t_abootimg* img, t_writer* w, off_t offset, size_t len)
+{
+  if (!len)
+    return;
+
+  if (!img->is_blkdev) {
+    zero_range(img, w, offset, len);
+    return;
+  }
+
+#if defined(BLKDISCARD) && defined(BLKZEROOUT)
+  uint64_t range[2] = { offset, len };
+  int fd = fileno(img->stream);
+
+  if ((img->tail == tail_discard) && ioctl(fd, BLKDISCARD, &range))
+    warn(img, "%s: cannot discard the end of the device\n", img->fname);
+  else if ((img->tail == tail_zeroout) && ioctl(fd, BLKZEROOUT, &range))
+    zero_range(img, w, offset, len);
+#else
+  if (img->tail == tail_zeroout)
+    zero_range(img, w, offset, len);
+#endif
+}
+
+
+
+/*
+ * Streams size bytes of a component from its source through the writer
+ * buffer, hashing them into ctx when given, and queueing them to be
+ * written at dst in the image when write is set, followed by zeros up to
+ * the next page. A component moving to a later offset inside the image
+ * is copied backwards, so that no chunk is overwritten before it has been
+ * read.
+ */
+static void stream_part(t_abootimg* img, t_writer* w, t_source* src, unsigned dst, unsigned size,
+                 HASH_CTX* ctx, int write)
+{
+  int fd = fileno(img->stream);
+  int backwards = write && (src->fd == fd) && (dst > src->offset);
+  unsigned psize = img->header.page_size;
+  size_t cloned = 0;
+  unsigned done, len, pos;
+
+  if (write && (src->fd != fd)) {
+    flush_writer(img, w);
+    cloned = reflink_range(src->fd, src->offset, fd, dst, size);
+  }
+  if (!ctx)
+    done = cloned;
+  else
+    done = 0;
+
+  for (; done < size; done += len) {
+    if (backwards)
+      flush_writer(img, w);
+    else if (w->used == IO_WINDOW) {
+      if (w->direct_fd != -1)
+        w->used = 0;  /* what was queued has been copied to the stage */
+      else
+        flush_writer(img, w);
+    }
+    len = size - done > IO_WINDOW - w->used ? IO_WINDOW - w->used : size - done;
+    pos = backwards ? size - done - len : done;
+
+    // the chunk has to be queued right after the pending bytes
+    if (write && w->n && (pos + len > cloned)) {
+      off_t to = dst + (pos > cloned ? pos : cloned);
+      if ((w->n == WRITE_IOVS) || (to != w->offset + w->len)) {
+        flush_writer(img, w);
+        len = size - done > IO_WINDOW ? IO_WINDOW : size - done;
+      }
+    }
+
+    const char* chunk;
+    if (src->map) {
+      // written straight from the shared mapping
+      chunk = src->map + src->offset + pos;
+    }
+    else {
+      chunk = w->buf + w->used;
+      ssize_t rb = pread(src->fd, w->buf + w->used, len, src->offset + pos);
+      if (rb < 0)
+        abort_perror(src->fname);
+      if (rb != len)
+        abort_printf("%s: unexpected end of file\n", src->fname);
+      img->bytes_read += len;
+    }
+
+    if (ctx)
+      HASH_update(ctx, chunk, len);
+
+    // the first cloned bytes are already there
+    unsigned skip = pos < cloned ? (cloned - pos < len ? cloned - pos : len) : 0;
+    if (write && (skip < len)) {
+      queue_write(img, w, chunk + skip, len - skip, dst + pos + skip);
+      if (!src->map)
+        w->used += len;
+    }
+  }
+
+  unsigned delta = size % psize;
+  if (write && delta)
+    zero_range(img, w, dst + size, psize - delta);
+
+  if (write && cloned)
+    report(img, "%zu bytes reflinked from %s, %zu bytes written\n", cloned, src->fname, size - cloned);
+  else if (write)
+    report(img, "%u bytes written\n", size);
+}
+
+
+
+static void start_read(t_abootimg* img, struct aiocb* cb, int fd, char* buf, off_t offset, size_t len)
+{
+  memset(cb, 0, sizeof(*cb));
+  cb->aio_fildes = fd;
+  cb->aio_buf = buf;
+  cb->aio_offset = offset;
+  cb->aio_nbytes = len;
+  if (aio_read(cb))
+    abort_perror(img->fname);
+}
+
+static ssize_t wait_read(struct aiocb* cb)
+{
+  const struct aiocb* list[1] = { cb };
+
+  while (aio_error(cb) == EINPROGRESS)
+    aio_suspend(list, 1, NULL);
+  return aio_return(cb);
+}
+
+/*
+ * Moves offset forward past the pages without a digest (components left
+ * in place, holes...), keeping it aligned.
+ */
+static off_t skip_unknown(t_writer* w, off_t offset, unsigned psize, size_t align)
+{
+  size_t page = (offset + psize - 1) / psize;
+
+  while ((page < w->nsums) && !w->sums[page])
+    page++;
+  if (page == w->nsums)
+    return offset;  /* past the last known page anyway */
+
+  off_t next = (off_t)page * psize / align * align;
+  return next > offset ? next : offset;
+}
+
+/*
+ * How much to read at offset: up to chunk bytes, without going past the
+ * end of the run of known pages there.
+ */
+static size_t known_run(t_writer* w, off_t offset, off_t end, size_t chunk, unsigned psize, size_t align)
+{
+  size_t page = offset / psize;
+
+  while ((page < w->nsums) && w->sums[page] && ((off_t)page * psize < offset + chunk))
+    page++;
+  off_t run_end = ((off_t)page * psize + align - 1) / align * align;
+  if (run_end > end)
+    run_end = end;
+  if (run_end <= offset)
+    run_end = offset + align;
+  return run_end - offset < chunk ? run_end - offset : chunk;
+}
+
+/*
+ * Reads back the pages with a known digest, from the medium rather than
+ * from the page cache, and compares them. Two IO_WINDOW buffers are used
+ * in turn: the next chunk is read with aio while the previous one is
+ * hashed. Returns the index of the first page which differs, or -1.
+ */
+static long verify_image(t_abootimg* img, t_writer* w)
+{
+  unsigned psize = img->header.page_size;
+  size_t align = (w->direct_fd != -1) && (w->align > psize) ? w->align : psize;
+  size_t chunk = IO_WINDOW / align * align;
+  char* buf[2];
+  struct aiocb cb[2];
+  size_t first, last, page;
+  struct timespec t0, t1;
+  long bad = -1;
+  int fd = -1;
+  int cur, i;
+
+  for (first = 0; (first < w->nsums) && !w->sums[first]; first++)
+    ;
+  for (last = w->nsums; (last > first) && !w->sums[last - 1]; last--)
+    ;
+  if (first == last)
+    return -1;
+
+#ifdef O_DIRECT
+  fd = open_file(img, img->fname, O_RDONLY | O_DIRECT, 0);
+#endif
+  if (fd == -1) {
+    fd = open_file(img, img->fname, O_RDONLY, 0);
+    if (fd == -1)
+      abort_perror(img->fname);
+  }
+  int held = hold_fd(fd);
+  // in case O_DIRECT is ignored, drop what the page cache holds
+  if (fdatasync(fileno(img->stream)) && !img->is_blkdev)
+    abort_perror(img->fname);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+  // a read is always waited for before anything aborts, so only the
+  // descriptor and the buffers are left behind
+  if (posix_memalign((void**)&buf[0], align, chunk))
+    buf[0] = NULL;
+  hold_mem(buf[0]);
+  if (posix_memalign((void**)&buf[1], align, chunk))
+    buf[1] = NULL;
+  hold_mem(buf[1]);
+  size_t npages = chunk / psize;
+  SHA_MB_SEG* segs = malloc(npages * sizeof(*segs));
+  hold_mem(segs);
+  SHA_MB_JOB* jobs = malloc(npages * sizeof(*jobs));
+  hold_mem(jobs);
+  size_t* pages = malloc(npages * sizeof(*pages));
+  hold_mem(pages);
+  if (!buf[0] || !buf[1] || !segs || !jobs || !pages) {
+    errno = ENOMEM;
+    abort_perror("");
+  }
+
+  // aligned range covering the known pages
+  off_t at = (off_t)first * psize / align * align;
+  off_t end = ((off_t)last * psize + align - 1) / align * align;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  memset(cb, 0, sizeof(cb));
+  start_read(img, &cb[0], fd, buf[0], at, known_run(w, at, end, chunk, psize, align));
+  at += cb[0].aio_nbytes;
+  at = skip_unknown(w, at, psize, align);
+
+  for (cur = 0; cb[cur].aio_nbytes; cur = !cur) {
+    ssize_t rb = wait_read(&cb[cur]);
+    if (rb < 0)
+      abort_perror(img->fname);
+    off_t got = cb[cur].aio_offset;
+    size_t asked = cb[cur].aio_nbytes;
+    cb[cur].aio_nbytes = 0;
+
+    // read the next chunk while this one is hashed
+    if ((rb == asked) && (at < end)) {
+      start_read(img, &cb[!cur], fd, buf[!cur], at, known_run(w, at, end, chunk, psize, align));
+      at += cb[!cur].aio_nbytes;
+      at = skip_unknown(w, at, psize, align);
+    }
+
+    img->bytes_verified += rb;
+
+    // the pages of the chunk are independent messages, hashed together
+    int n = 0;
+    for (page = got / psize; (page < last) && ((page + 1) * psize <= got + rb); page++) {
+      if (!w->sums[page])
+        continue;
+      segs[n].data = buf[cur] + (page * psize - got);
+      segs[n].len = psize;
+      jobs[n].segs = &segs[n];
+      jobs[n].nsegs = 1;
+      pages[n++] = page;
+    }
+    SHA_mb_hash(jobs, n);
+    for (i = 0; i < n; i++)
+      if (digest_sum(jobs[i].digest) != w->sums[pages[i]]) {
+        bad = pages[i];
+        break;
+      }
+    if ((bad == -1) && (page < last) && (rb < asked))
+      bad = page;  /* short read */
+
+    if (bad != -1) {
+      if (cb[!cur].aio_nbytes) {
+        aio_cancel(fd, &cb[!cur]);
+        wait_read(&cb[!cur]);
+      }
+      break;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  img->verify_time = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+  let_go_since(held);
+  close(fd);
+  free(buf[0]);
+  free(buf[1]);
+  free(segs);
+  free(jobs);
+  free(pages);
+  return bad;
+}
+
+
+
+/*
+ * Alignment of O_DIRECT writes: the physical block size of a block
+ * device, so that it never has to read-modify-write, or the block size of
+ * the filesystem holding a file.
+ */
+static size_t direct_alignment(int fd)
+{
+  size_t align = 0;
+
+#if defined(BLKSSZGET) && defined(BLKPBSZGET)
+  int lbs;
+  unsigned int pbs;
+  if (!ioctl(fd, BLKSSZGET, &lbs) && !ioctl(fd, BLKPBSZGET, &pbs))
+    align = pbs > lbs ? pbs : lbs;
+#endif
+
+  struct stat st;
+  if (!align && !fstat(fd, &st))
+    align = st.st_blksize;
+
+  return align ? align : 4096;
+}
+
+/*
+ * Switches the writer to O_DIRECT on a second descriptor of the image.
+ * Falls back to buffered writes when O_DIRECT is not supported.
+ */
+static void open_direct(t_abootimg* img, t_writer* w)
+{
+#ifdef O_DIRECT
+  int fd = open_file(img, img->fname, O_RDWR | O_DIRECT, 0);
+  if (fd == -1) {
+    warn(img, "%s: no O_DIRECT, using buffered writes\n", img->fname);
+    return;
+  }
+
+  w->align = direct_alignment(fd);
+  if ((IO_WINDOW % w->align) ||
+      posix_memalign((void**)&w->stage, w->align, IO_WINDOW) ||
+      posix_memalign((void**)&w->block, w->align, w->align)) {
+    close(fd);
+    warn(img, "%s: cannot align to %zu bytes, using buffered writes\n", img->fname, w->align);
+    return;
+  }
+
+  w->direct_fd = fd;
+  report(img, "  O_DIRECT writes, aligned to %zu bytes\n", w->align);
+#endif
+}
+
+
+
+static void release_writer(t_writer* w)
+{
+  if (w->direct_fd != -1)
+    close(w->direct_fd);
+  free(w->stage);
+  free(w->block);
+  free(w->sums);
+  free(w->cmp);
+  free(w->buf);
+  free((char*)w->zero);
+  memset(w, 0, sizeof(*w));
+  w->direct_fd = -1;
+}
+
+
+
+/*
+ * Writes the image through a single IO_WINDOW buffer. Components which
+ * moved to a later offset are moved first, last one first; then the other
+ * components are written in order, consecutive chunks and padding being
+ * gathered into pwritev calls; then the header, since it holds the id.
+ * The id is computed while writing, unless components had to be moved
+ * first, in which case it is computed beforehand.
+ */
+static void write_bootimg(t_abootimg* img)
+{
+  static const char* names[nparts] = { "kernel", "ramdisk", "second stage", "device tree" };
+  unsigned* hsize[nparts] = { &img->header.kernel_size, &img->header.ramdisk_size,
+                              &img->header.second_size, &img->header.dt_size };
+  int fd = fileno(img->stream);
+  unsigned psize;
+  char* zero;
+  t_writer w;
+  HASH_CTX ctx;
+  HASH_CTX midstate;
+  uint64_t fp = 0;
+  int hit = 0;
+  unsigned offset[nparts], size[nparts];
+  int later[nparts], kept[nparts];
+  int moves_later = 0;
+  t_view kview;
+  int i;
+
+  report(img, "Writing Boot Image %s\n", img->fname);
+
+  psize = img->header.page_size;
+  memset(&w, 0, sizeof(w));
+  w.direct_fd = -1;
+  img->writer = &w;  /* released by abootimg_run on errors */
+  zero = calloc(psize, 1);
+  w.buf = malloc(IO_WINDOW);
+  w.zero = zero;
+  w.zero_len = psize;
+  if (!zero || !w.buf)
+    abort_perror("");
+
+  struct stat st;
+  if (!img->is_blkdev && !fstat(fd, &st) && S_ISREG(st.st_mode))
+    w.hole_size = st.st_blksize;
+
+  if ((img->direct == 1) || (img->is_blkdev && (img->direct == -1)))
+    open_direct(img, &w);
+
+  if (img->diff_write) {
+    // O_DIRECT writes can only be skipped by whole aligned blocks
+    w.unit = (w.direct_fd != -1) && (w.align > psize) ? w.align : psize;
+    if (posix_memalign((void**)&w.cmp, w.unit, IO_WINDOW))
+      abort_perror("");
+    w.cmp_offset = -IO_WINDOW;
+  }
+
+  if (img->verify) {
+    w.nsums = (img->size + psize - 1) / psize;
+    w.sums = calloc(w.nsums, sizeof(*w.sums));
+    if (!w.sums)
+      abort_perror("");
+    w.page_at = -1;
+  }
+
+  get_layout(&img->header, offset, size);
+
+  for (i = 0; i < nparts; i++) {
+    t_source* src = &img->src[i];
+    kept[i] = (src->fd == fd) && (src->offset == offset[i]);
+    later[i] = size[i] && (src->fd == fd) && (offset[i] > src->offset);
+    moves_later |= later[i];
+  }
+
+  // the image is only written through its file descriptor from now on
+  fflush(img->stream);
+
+  init_id_hash(&ctx, img->id_algo);
+  midstate = ctx;
+  if (img->idcache_fname && !img->id_known) {
+    t_source* k = &img->src[part_kernel];
+    if (!open_view(k->fd, k->offset, size[part_kernel], &kview) && kview.data) {
+      fp = fingerprint(kview.data, img->header.kernel_size);
+      hit = load_id_cache(img, fp, &ctx);
+      img->bytes_read += size[part_kernel];
+    }
+    close_view(&kview);
+  }
+
+  if (moves_later) {
+    // hash everything while it is still where the sources say
+    for (i = 0; (i < nparts) && !img->id_known; i++) {
+      if ((i == part_devtree) && !size[i])
+        break;
+      if ((i != part_kernel) || !hit) {
+        stream_part(img, &w, &img->src[i], offset[i], size[i], &ctx, 0);
+        HASH_update(&ctx, hsize[i], sizeof(*hsize[i]));
+      }
+      if (i == part_kernel)
+        midstate = ctx;
+    }
+
+    for (i = nparts - 1; i >= 0; i--) {
+      if (later[i]) {
+        report(img, "  %s: moved, ", names[i]);
+        stream_part(img, &w, &img->src[i], offset[i], size[i], NULL, 1);
+      }
+    }
+    flush_writer(img, &w);
+  }
+
+  for (i = 0; i < nparts; i++) {
+    // hashed above, or restored from the id cache
+    HASH_CTX* c = moves_later || img->id_known || ((i == part_kernel) && hit) ? NULL : &ctx;
+
+    if (kept[i] || later[i]) {
+      if (size[i] && !later[i])
+        report(img, "  %s: kept in place\n", names[i]);
+      if (c)
+        stream_part(img, &w, &img->src[i], offset[i], size[i], c, 0);
+    }
+    else {
+      report(img, "  %s: ", names[i]);
+      stream_part(img, &w, &img->src[i], offset[i], size[i], c, 1);
+    }
+
+    if (c && ((i != part_devtree) || size[i]))
+      HASH_update(c, hsize[i], sizeof(*hsize[i]));
+    if ((i == part_kernel) && !moves_later)
+      midstate = ctx;
+  }
+
+  unsigned total_size = offset[part_devtree] + (size[part_devtree] + psize - 1) / psize * psize;
+  if (img->size > total_size)
+    clear_tail(img, &w, total_size, img->size - total_size);
+  flush_writer(img, &w);
+
+  if (!img->id_known)
+    final_id_hash(&ctx, img->header.id);
+
+  if (img->idcache_fname && !img->id_known) {
+    report(img, "id cache %s: kernel %s\n", img->idcache_fname, hit ? "prefix reused" : "hashed");
+    save_id_cache(img, fp, &midstate, hit);
+  }
+
+  queue_write(img, &w, (const char*)&img->header, sizeof(img->header), 0);
+  queue_write(img, &w, zero, psize - sizeof(img->header), sizeof(img->header));
+  flush_writer(img, &w);
+
+  if ((w.direct_fd != -1) && fsync(w.direct_fd))
+    abort_perror(img->fname);
+
+  long bad = -1;
+  if (img->verify)
+    bad = verify_image(img, &w);
+
+  release_writer(&w);
+  img->writer = NULL;
+
+  if (ftruncate(fd, img->size) && !img->is_blkdev)
+    abort_perror(img->fname);
+
+  report(img, "%llu bytes read, %llu bytes written in %u write calls (%.1f ms)\n",
+          img->bytes_read, img->bytes_written, img->write_calls, img->write_time * 1000);
+  if (img->bytes_holes)
+    report(img, "%llu bytes of padding left as holes\n", img->bytes_holes);
+  if (img->diff_write)
+    report(img, "%llu of %llu pages unchanged and skipped\n",
+            img->pages_same, img->pages_same + img->pages_diff);
+  if (img->verify) {
+    report(img, "verify: %llu bytes read back in %.1f ms (%.1f MB/s)\n", img->bytes_verified,
+            img->verify_time * 1000, img->bytes_verified / (img->verify_time + 1e-9) / 1e6);
+    if (bad != -1)
+      abort_printf("%s: verify failed, page %ld (offset 0x%lx) differs\n",
+                   img->fname, bad, bad * (unsigned long)psize);
+  }
+}
+
+
+
+static void close_sources(t_abootimg* img)
+{
+  int i;
+
+  for (i = 0; i < nparts; i++) {
+    t_source* src = &img->src[i];
+    if ((src->fd != -1) && (!img->stream || (src->fd != fileno(img->stream))))
+      close(src->fd);
+    src->fd = -1;
+  }
+}
+
+
+
+/*
+ * Feeds the components of the image, as laid out by its header, to n
+ * id hashes at once.
+ */
+static void hash_image_id(t_abootimg* img, HASH_CTX* ctx, int n)
+{
+  unsigned offset[nparts], size[nparts];
+  t_hashes h = { ctx, n };
+  int i;
+
+  get_layout(&img->header, offset, size);
+  for (i = 0; i < nparts; i++) {
+    if ((i == part_devtree) && !size[i])
+      break;
+    for_each_window(img, offset[i], size[i], hash_window, &h);
+    hash_window((const char*)&size[i], sizeof(size[i]), &h);
+  }
+}
+
+/*
+ * The algorithm told by the length of the id is checked against the
+ * content: a null tail is also what an id which is not a hash may leave.
+ */
+static void print_id_algo(t_abootimg* img)
+{
+  int algo = header_id_algo(&img->header);
+  const char* name = algo == id_sha256 ? "sha256" : "sha1";
+  unsigned zero[8] = { 0 };
+  unsigned id[8];
+  HASH_CTX ctx;
+
+  if (!memcmp(img->header.id, zero, sizeof(zero)))
+    return;
+
+  init_id_hash(&ctx, algo);
+  hash_image_id(img, &ctx, 1);
+  final_id_hash(&ctx, id);
+
+  if (!memcmp(id, img->header.id, sizeof(id)))
+    report(img, "* id algorithm = %s\n\n", name);
+  else
+    report(img, "* id algorithm = %s by its length, but the id does not match the content\n\n", name);
+}
+
+
+
+/*
+ * An update which only changes header fields that are not part of the
+ * layout (cmdline, name, load addresses, ...) does not need to touch the
+ * components: the id only covers their content and sizes.
+ */
+static int is_header_only_update(t_abootimg* img)
+{
+  if (img->kernel_fname || img->ramdisk_fname || img->second_fname || img->devtree_fname)
+    return 0;
+
+  return (img->header.page_size == img->orig_header.page_size) &&
+         (img->header.dt_size == img->orig_header.dt_size);
+}
+
+
+
+static void write_header_only(t_abootimg* img)
+{
+  unsigned psize = img->header.page_size;
+  unsigned offset[nparts], size[nparts];
+
+  get_layout(&img->header, offset, size);
+  unsigned total_size = offset[part_devtree] + (size[part_devtree] + psize - 1) / psize * psize;
+  if (total_size > img->size)
+    abort_printf("%s: updated is too big for the Boot Image (%u vs %u bytes)\n", img->fname, total_size, img->size);
+
+  report(img, "Writing Boot Image header of %s\n", img->fname);
+
+  // the id only needs recomputing when its algorithm is changed
+  if (img->id_algo != header_id_algo(&img->orig_header)) {
+    HASH_CTX ctx;
+    init_id_hash(&ctx, img->id_algo);
+    hash_image_id(img, &ctx, 1);
+    final_id_hash(&ctx, img->header.id);
+  }
+
+  char* zero = calloc(psize, 1);
+  if (!zero)
+    abort_perror("");
+  int h = hold_mem(zero);
+  struct iovec iov[2] = {
+    { &img->header, sizeof(img->header) },
+    { zero, psize - sizeof(img->header) }
+  };
+  write_iov(img, fileno(img->stream), iov, 2, 0);
+
+  if (!img->is_blkdev && (img->size != img->orig_size))
+    if (ftruncate(fileno(img->stream), img->size))
+      abort_perror(img->fname);
+
+  let_go(h);
+  free(zero);
+}
+
+
+
+static void print_id_cache_info(t_abootimg* img)
+{
+  t_idcache c;
+  char* name = idcache_name(img->fname);
+
+  FILE* f = fopen_file(img, name, "r");
+  if (f) {
+    size_t rb = fread(&c, sizeof(c), 1, f);
+    fclose(f);
+
+    if ((rb != 1) || memcmp(c.magic, IDCACHE_MAGIC, sizeof(c.magic)))
+      report(img, "* id cache = %s is not a valid id cache\n\n", name);
+    else if (memcmp(c.id, img->header.id, sizeof(c.id)))
+      report(img, "* id cache = %s is stale (written for another id)\n\n", name);
+    else
+      report(img, "* id cache = %s, kernel prefix %s\n\n", name,
+              c.hit ? "reused from cache" : "hashed");
+  }
+  free(name);
+}
+
+
+
+static void print_bootimg_info(t_abootimg* img)
+{
+  report(img, "\nAndroid Boot Image Info:\n\n");
+
+  report(img, "* file name = %s %s\n\n", img->fname, img->is_blkdev ? "[block device]":"");
+
+  report(img, "* image size = %u bytes (%.2f MB)\n", img->size, (double)img->size/0x100000);
+  report(img, "  page size  = %u bytes\n\n", img->header.page_size);
+
+  report(img, "* Boot Name = \"%s\"\n\n", img->header.name);
+
+  unsigned kernel_size = img->header.kernel_size;
+  unsigned ramdisk_size = img->header.ramdisk_size;
+  unsigned second_size = img->header.second_size;
+  unsigned devtree_size = img->header.dt_size;
+
+  report(img, "* kernel size       = %u bytes (%.2f MB)\n", kernel_size, (double)kernel_size/0x100000);
+  report(img, "  ramdisk size      = %u bytes (%.2f MB)\n", ramdisk_size, (double)ramdisk_size/0x100000);
+  if (second_size)
+    report(img, "  second stage size = %u bytes (%.2f MB)\n", ramdisk_size, (double)ramdisk_size/0x100000);
+  if(devtree_size)
+    report(img, "  device tree size  = %u bytes (%.2f MB)\n", devtree_size, (double)devtree_size/0x100000);
+ 
+  report(img, "\n* load addresses:\n");
+  report(img, "  kernel:       0x%08x\n", img->header.kernel_addr);
+  report(img, "  ramdisk:      0x%08x\n", img->header.ramdisk_addr);
+  if (second_size)
+    report(img, "  second stage: 0x%08x\n", img->header.second_addr);
+  if (devtree_size)
+    report(img, "  device tree:  0x%08x\n", img->header.dt_size);
+  report(img, "  tags:         0x%08x\n\n", img->header.tags_addr);
+
+  if (img->header.cmdline[0])
+    report(img, "* cmdline = %s\n\n", img->header.cmdline);
+  else
+    report(img, "* empty cmdline\n");
+
+  report(img, "* id = ");
+  int i;
+  for (i=0; i<8; i++)
+    report(img, "0x%08x ", img->header.id[i]);
+  report(img, "\n\n");
+
+  print_id_algo(img);
+  print_id_cache_info(img);
+}
+
+
+
+static void write_bootimg_config(t_abootimg* img)
+{
+  report(img, "writing boot image config in %s\n", img->config_fname);
+
+  FILE* config_file = fopen_file(img, img->config_fname, "w");
+  if (!config_file)
+    abort_perror(img->config_fname);
+
+  fprintf(config_file, "bootsize = 0x%x\n", img->size);
+  fprintf(config_file, "pagesize = 0x%x\n", img->header.page_size);
+
+  fprintf(config_file, "kerneladdr = 0x%x\n", img->header.kernel_addr);
+  fprintf(config_file, "ramdiskaddr = 0x%x\n", img->header.ramdisk_addr);
+  fprintf(config_file, "secondaddr = 0x%x\n", img->header.second_addr);
+  fprintf(config_file, "devtree = 0x%x\n", img->header.dt_size);
+  fprintf(config_file, "tagsaddr = 0x%x\n", img->header.tags_addr);
+
+  fprintf(config_file, "name = %s\n", img->header.name);
+  fprintf(config_file, "cmdline = %s\n", img->header.cmdline);
+  // sha1 is the default, and older versions reject the entry
+  if (img->id_algo != id_sha1)
+    fprintf(config_file, "idalgo = sha256\n");
+  
+  fclose(config_file);
+}
+
+
+
+static void write_window(const char* data, size_t len, void* arg)
+{
+  int fd = *(int*)arg;
+
+  while (len) {
+    ssize_t wb = write(fd, data, len);
+    if (wb < 0) {
+      if (errno == EINTR)
+        continue;
+      abort_perror("write");
+    }
+    data += wb;
+    len -= wb;
+  }
+}
+
+
+
+/*
+ * Copies len bytes at offset of in_fd to the current position of out_fd
+ * without going through user space: copy_file_range (which can share
+ * extents or use server side copy), then sendfile. Returns how many bytes
+ * were copied; the caller copies what is left by itself.
+ */
+static size_t copy_in_kernel(int in_fd, off_t offset, int out_fd, size_t len)
+{
+  size_t done = 0;
+
+#ifdef __linux__
+  loff_t in_off = offset;
+  while (done < len) {
+    ssize_t n = copy_file_range(in_fd, &in_off, out_fd, NULL, len - done, 0);
+    if (n <= 0)
+      break;  /* ENOSYS, EXDEV, EINVAL... */
+    done += n;
+  }
+
+  off_t off = offset + done;
+  while (done < len) {
+    ssize_t n = sendfile(out_fd, in_fd, &off, len - done);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+#endif
+
+  return done;
+}
+
+
+
+static void extract_part(t_abootimg* img, int part, char* fname)
+{
+  unsigned offset[nparts], size[nparts];
+
+  get_layout(&img->header, offset, size);
+
+  int fd = open_file(img, fname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1)
+    abort_perror(fname);
+  int h = hold_fd(fd);
+
+  // share whole blocks, then copy the partial last one
+  size_t cloned = reflink_range(fileno(img->stream), offset[part], fd, 0, size[part]);
+  if (cloned && (lseek(fd, cloned, SEEK_SET) == -1))
+    abort_perror(fname);
+
+  size_t copied = copy_in_kernel(fileno(img->stream), offset[part] + cloned, fd, size[part] - cloned);
+  size_t done = cloned + copied;
+  img->bytes_read += done;
+  if (done < size[part])
+    for_each_window(img, offset[part] + done, size[part] - done, write_window, &fd);
+
+  if (cloned)
+    report(img, "  %zu bytes reflinked, %u bytes copied\n", cloned, (unsigned)(size[part] - cloned));
+  else if (copied)
+    report(img, "  %zu bytes copied in kernel\n", copied);
+  else
+    report(img, "  %u bytes copied\n", size[part]);
+
+  img->bytes_written += size[part];
+
+  let_go(h);
+  if (close(fd))
+    abort_perror(fname);
+}
+
+
+
+static void extract_kernel(t_abootimg* img)
+{
+  report(img, "extracting kernel in %s\n", img->kernel_fname);
+  extract_part(img, part_kernel, img->kernel_fname);
+}
+
+
+
+static void extract_ramdisk(t_abootimg* img)
+{
+  report(img, "extracting ramdisk in %s\n", img->ramdisk_fname);
+  extract_part(img, part_ramdisk, img->ramdisk_fname);
+}
+
+
+
+static void extract_second(t_abootimg* img)
+{
+  if (!img->header.second_size) // Second Stage not present
+    return;
+
+  report(img, "extracting second stage image in %s\n", img->second_fname);
+  extract_part(img, part_second, img->second_fname);
+}
+
+static void extract_devtree(t_abootimg* img)
+{
+  if (!img->header.dt_size) // Device tree not present
+    return;
+
+  report(img, "extracting device tree image in %s\n", img->devtree_fname);
+  extract_part(img, part_devtree, img->devtree_fname);
+}
+
+
+static void open_for_create(t_abootimg* img)
+{
+  // --diff-write compares with what is already there
+  if (!img->diff_write)
+    open_bootimg(img, "w");
+  else if (!(img->stream = fopen_file(img, img->fname, "r+")) && (errno == ENOENT))
+    open_bootimg(img, "w+");
+  else if (!img->stream)
+    abort_perror(img->fname);
+}
+
+
+
+/*
+ * One of several targets of --create, written by its own thread.
+ */
+typedef struct
+{
+  t_abootimg   img;
+  pthread_t    thread;
+  int          started;
+  int          ok;
+  char         msg[256];
+  double       time;
+} t_target;
+
+static void* write_target(void* arg)
+{
+  t_target* t = arg;
+  t_trap tr;
+  struct timespec t0, t1;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  tr.nheld = 0;
+  trap = &tr;
+  if (!setjmp(tr.env)) {
+    open_for_create(&t->img);
+    write_bootimg(&t->img);
+    if (fclose(t->img.stream))
+      abort_perror(t->img.fname);
+    t->img.stream = NULL;
+    t->ok = 1;
+  }
+  else {
+    snprintf(t->msg, sizeof(t->msg), "%s", tr.msg);
+    release_held(&tr);
+    if (t->img.writer)
+      release_writer(t->img.writer);
+    if (t->img.stream)
+      fclose(t->img.stream);
+  }
+  trap = NULL;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  t->time = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  return NULL;
+}
+
+/*
+ * The id message of an image, as segments: each component mapped in
+ * views followed by its size. Returns the number of segments.
+ */
+static int id_segments(t_abootimg* img, const t_view* views, SHA_MB_SEG* segs)
+{
+  unsigned* hsize[nparts] = { &img->header.kernel_size, &img->header.ramdisk_size,
+                              &img->header.second_size, &img->header.dt_size };
+  int i, n = 0;
+
+  for (i = 0; i < nparts; i++) {
+    if ((i == part_devtree) && !*hsize[i])
+      break;
+    segs[n].data = views[i].data;
+    segs[n++].len = *hsize[i];
+    segs[n].data = hsize[i];
+    segs[n++].len = sizeof(*hsize[i]);
+  }
+  return n;
+}
+
+/*
+ * Hashes the SHA-1 ids of several prepared images together, one message
+ * per SIMD lane. The images which cannot be mapped, use another algorithm
+ * or an id cache are left to hash their id while they are written.
+ */
+void abootimg_hash_ids(t_abootimg** imgs, int n)
+{
+  t_view* views = calloc((size_t)n * nparts, sizeof(*views));
+  SHA_MB_SEG* segs = malloc((size_t)n * 2 * nparts * sizeof(*segs));
+  SHA_MB_JOB* jobs = malloc(n * sizeof(*jobs));
+  t_abootimg** hashed = malloc(n * sizeof(*hashed));
+  unsigned offset[nparts], size[nparts];
+  int njobs = 0;
+  int i, j;
+
+  if (!views || !segs || !jobs || !hashed)
+    goto out;
+
+  for (i = 0; i < n; i++) {
+    t_abootimg* img = imgs[i];
+    t_view* v = &views[njobs * nparts];
+
+    if (!img->prepared || img->id_known || (img->id_algo != id_sha1) || img->idcache_fname)
+      continue;
+    get_layout(&img->header, offset, size);
+    for (j = 0; j < nparts; j++)
+      if ((size[j] > INT_MAX) ||
+          open_view(img->src[j].fd, img->src[j].offset, size[j], &v[j]))
+        break;
+    if (j < nparts) {
+      while (j--)
+        close_view(&v[j]);
+      continue;
+    }
+    jobs[njobs].segs = &segs[njobs * 2 * nparts];
+    jobs[njobs].nsegs = id_segments(img, v, &segs[njobs * 2 * nparts]);
+    hashed[njobs++] = img;
+  }
+
+  SHA_mb_hash(jobs, njobs);
+  for (i = 0; i < njobs; i++) {
+    sha1_id(jobs[i].digest, hashed[i]->header.id);
+    hashed[i]->id_known = 1;
+    for (j = 0; j < nparts; j++) {
+      hashed[i]->bytes_read += views[i * nparts + j].size;
+      close_view(&views[i * nparts + j]);
+    }
+  }
+
+out:
+  free(views);
+  free(segs);
+  free(jobs);
+  free(hashed);
+}
+
+/*
+ * --create with several targets: the inputs are read, mapped and hashed
+ * once, then each target is checked and written by its own thread from
+ * the shared mappings. Returns the number of targets which failed.
+ */
+static int create_targets(t_abootimg* img)
+{
+  unsigned offset[nparts], size[nparts];
+  t_view views[nparts];
+  HASH_CTX ctx;
+  int failed = 0;
+  int i;
+
+  update_header(img);
+  update_images(img);
+  if (check_boot_img_header(img))
+    abort_printf("%s: Sanity cheks failed", img->fname);
+
+  get_layout(&img->header, offset, size);
+  unsigned total_size = offset[part_devtree] +
+    (size[part_devtree] + img->header.page_size - 1) / img->header.page_size * img->header.page_size;
+
+  int held = trap->nheld;
+  for (i = 0; i < nparts; i++) {
+    t_source* src = &img->src[i];
+    if (open_view(src->fd, src->offset, size[i], &views[i]))
+      abort_perror(src->fname);
+    hold_map(views[i].map, views[i].maplen);
+    src->map = views[i].data;
+  }
+
+  SHA_MB_SEG segs[2 * nparts];
+  int nsegs = id_segments(img, views, segs);
+  if (img->id_algo == id_sha1) {
+    SHA_MB_JOB job = { segs, nsegs };
+    SHA_mb_hash(&job, 1);
+    sha1_id(job.digest, img->header.id);
+  }
+  else {
+    init_id_hash(&ctx, img->id_algo);
+    for (i = 0; i < nsegs; i++)
+      HASH_update(&ctx, segs[i].data, segs[i].len);
+    final_id_hash(&ctx, img->header.id);
+  }
+  img->id_known = 1;
+
+  t_target* t = calloc(img->ntargets, sizeof(*t));
+  if (!t)
+    abort_perror("");
+  hold_mem(t);
+
+  // safety checks first, one target at a time
+  t_trap* outer = trap;
+  for (i = 0; i < img->ntargets; i++) {
+    t_trap tr;
+
+    t[i].img = *img;
+    t[i].img.fname = img->targets[i];
+    t[i].img.quiet = 1;
+    t[i].img.stream = NULL;
+    t[i].img.targets = NULL;
+    t[i].img.idcache_fname = NULL;
+
+    tr.nheld = 0;
+    trap = &tr;
+    if (!setjmp(tr.env)) {
+      check_if_block_device(&t[i].img);
+      if (total_size > t[i].img.size)
+        abort_printf("%s: image is too big for the target (%u vs %u bytes)",
+                     t[i].img.fname, total_size, t[i].img.size);
+      // marked before the thread can finish, and joined whatever it did
+      t[i].started = 1;
+      int err = pthread_create(&t[i].thread, NULL, write_target, &t[i]);
+      if (err) {
+        t[i].started = 0;
+        errno = err;
+        abort_perror(t[i].img.fname);
+      }
+    }
+    else {
+      snprintf(t[i].msg, sizeof(t[i].msg), "%s", tr.msg);
+      release_held(&tr);
+    }
+    trap = outer;
+  }
+
+  for (i = 0; i < img->ntargets; i++)
+    if (t[i].started)
+      pthread_join(t[i].thread, NULL);
+
+  report(img, "%-24s %-6s %12s %10s %10s\n", "target", "result", "bytes", "ms", "MB/s");
+  for (i = 0; i < img->ntargets; i++) {
+    t_abootimg* ti = &t[i].img;
+    if (t[i].ok == 1)
+      report(img, "%-24s %-6s %12llu %10.1f %10.1f\n", ti->fname, "ok", ti->bytes_written,
+              t[i].time * 1000, ti->bytes_written / (t[i].time + 1e-9) / 1e6);
+    else {
+      report(img, "%-24s %-6s %s\n", ti->fname, "FAILED", t[i].msg);
+      failed++;
+    }
+  }
+
+  let_go_since(held);
+  for (i = 0; i < nparts; i++)
+    close_view(&views[i]);
+  close_sources(img);
+  free(t);
+  return failed;
+}
+
+
+
+t_abootimg* abootimg_new(const t_abootimg_io* io)
+{
+  t_abootimg* img;
+  int i;
+
+  img = calloc(sizeof(t_abootimg), 1);
+  if (!img)
+    return NULL;
+
+  if (io)
+    img->io = *io;
+  img->config_fname = "bootimg.cfg";
+  img->kernel_fname = "zImage";
+  img->ramdisk_fname = "initrd.img";
+  img->second_fname = "stage2.img";
+  img->devtree_fname = "dt.img";
+  img->direct = -1;
+  img->format = -1;
+  for (i = 0; i < nparts; i++)
+    img->src[i].fd = -1;
+
+  memcpy(img->header.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+  img->header.page_size = 2048;  // a sensible default page size
+
+  return img;
+}
+
+
+/*
+ * Gives back what a command which failed halfway still holds.
+ */
+static void release_bootimg(t_abootimg* img)
+{
+  if (img->writer)
+    release_writer(img->writer);
+  img->writer = NULL;
+  close_sources(img);
+  if (img->stream)
+    fclose(img->stream);
+  img->stream = NULL;
+}
+
+
+void abootimg_free(t_abootimg* img)
+{
+  if (!img)
+    return;
+  release_bootimg(img);
+  free(img->idcache_fname);
+  free(img->targets);
+  free(img);
+}
+
+
+
+/*
+ * The part of a command which reads its inputs, before anything is
+ * written: done by abootimg_prepare, or else by run_command.
+ */
+static void prepare_command(t_abootimg* bootimg, enum abootimg_command cmd)
+{
+  switch(cmd)
+  {
+    case cmd_update:
+      open_bootimg(bootimg, "r+");
+      read_header(bootimg);
+      update_header(bootimg);
+      if (!is_header_only_update(bootimg))
+        update_images(bootimg);
+      break;
+
+    case cmd_create:
+      if (bootimg->ntargets > 1)
+        return;  /* create_targets */
+      check_if_block_device(bootimg);
+      open_for_create(bootimg);
+      update_header(bootimg);
+      update_images(bootimg);
+      if (check_boot_img_header(bootimg))
+        abort_printf("%s: Sanity cheks failed", bootimg->fname);
+      break;
+
+    default:
+      return;
+  }
+  bootimg->prepared = 1;
+}
+
+static int run_command(t_abootimg* bootimg, enum abootimg_command cmd)
+{
+  switch(cmd)
+  {
+    case cmd_none:
+    case cmd_help:
+      snprintf(bootimg->error, sizeof(bootimg->error), "bad arguments");
+      return abootimg_einval;
+
+    case cmd_info:
+      open_bootimg(bootimg, "r");
+      read_header(bootimg);
+      print_bootimg_info(bootimg);
+      break;
+
+    case cmd_extract:
+      open_bootimg(bootimg, "r");
+      read_header(bootimg);
+      write_bootimg_config(bootimg);
+      extract_kernel(bootimg);
+      extract_ramdisk(bootimg);
+      extract_second(bootimg);
+      extract_devtree(bootimg);
+      break;
+    
+    case cmd_update:
+      if (!bootimg->prepared)
+        prepare_command(bootimg, cmd);
+      if (is_header_only_update(bootimg)) {
+        write_header_only(bootimg);
+        break;
+      }
+      write_bootimg(bootimg);
+      close_sources(bootimg);
+      break;
+
+    case cmd_create:
+      if (bootimg->ntargets > 1) {
+        int failed = create_targets(bootimg);
+        if (!failed)
+          break;
+        snprintf(bootimg->error, sizeof(bootimg->error),
+                 "%d of %d targets failed", failed, bootimg->ntargets);
+        return abootimg_etargets;
+      }
+      if (!bootimg->prepared)
+        prepare_command(bootimg, cmd);
+      write_bootimg(bootimg);
+      close_sources(bootimg);
+      break;
+
+    case cmd_pack_initrd:
+      pack_initrd(bootimg);
+      break;
+
+    case cmd_unpack_initrd:
+      unpack_initrd(bootimg);
+      break;
+  }
+
+  return abootimg_ok;
+}
+
+
+
+/*
+ * Entry points: errors raised below them jump back to the trap they set
+ * and are returned as error codes, the message being kept in the handle.
+ */
+static int trapped(t_abootimg* img, t_trap* tr)
+{
+  release_held(tr);
+  snprintf(img->error, sizeof(img->error), "%s", tr->msg);
+  img->error_errno = tr->err;
+  return tr->code;
+}
+
+int abootimg_parse_args(t_abootimg* img, int argc, char** argv)
+{
+  t_trap tr;
+  t_trap* outer = trap;
+  int ret;
+
+  tr.nheld = 0;
+  trap = &tr;
+  if (!setjmp(tr.env))
+    ret = parse_args(argc, argv, img);
+  else
+    ret = trapped(img, &tr);
+  trap = outer;
+  return ret;
+}
+
+int abootimg_run(t_abootimg* img, enum abootimg_command cmd)
+{
+  t_trap tr;
+  t_trap* outer = trap;
+  int ret;
+
+  img->error[0] = 0;
+  img->error_errno = 0;
+
+  tr.nheld = 0;
+  trap = &tr;
+  if (!setjmp(tr.env))
+    ret = run_command(img, cmd);
+  else {
+    ret = trapped(img, &tr);
+    release_bootimg(img);
+  }
+  trap = outer;
+  return ret;
+}
+
+int abootimg_prepare(t_abootimg* img, enum abootimg_command cmd)
+{
+  t_trap tr;
+  t_trap* outer = trap;
+  int ret = abootimg_ok;
+
+  img->error[0] = 0;
+  img->error_errno = 0;
+
+  tr.nheld = 0;
+  trap = &tr;
+  if (!setjmp(tr.env))
+    prepare_command(img, cmd);
+  else {
+    ret = trapped(img, &tr);
+    release_bootimg(img);
+  }
+  trap = outer;
+  return ret;
+}
+
+const char* abootimg_strerror(const t_abootimg* img)
+{
+  return img->error;
+}
+
+int abootimg_errno(const t_abootimg* img)
+{
+  return img->error_errno;
+}
+
+void abootimg_get_stats(const t_abootimg* img, t_abootimg_stats* stats)
+{
+  stats->bytes_read = img->bytes_read;
+  stats->bytes_written = img->bytes_written;
+}
@@ -0,0 +1,117 @@
+/* libabootimg.h - read, modify and create Android Boot Images
+ *
+ * A handle holds one command and everything it works on: handles share
+ * nothing, so that several of them can be used at once, one thread per
+ * handle. Functions never end the process: they return a negative error
+ * code, the message of which is kept in the handle.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef LIBABOOTIMG_H_
+#define LIBABOOTIMG_H_
+
+#include <sys/types.h>
+
+typedef struct abootimg t_abootimg;
+
+
+enum abootimg_command {
+  cmd_none,       /* bad arguments */
+  cmd_help,
+  cmd_info,
+  cmd_extract,
+  cmd_update,
+  cmd_create,
+  cmd_pack_initrd,
+  cmd_unpack_initrd
+};
+
+
+enum abootimg_error {
+  abootimg_ok = 0,
+  abootimg_esys = -1,      /* a system call failed, see abootimg_errno */
+  abootimg_einval = -2,    /* invalid image, configuration or arguments */
+  abootimg_etargets = -3   /* some of several --create targets failed */
+};
+
+
+/* levels of the messages given to the log callback */
+enum abootimg_log {
+  log_info,       /* progress and command output */
+  log_warning
+};
+
+
+/*
+ * How a handle reaches the outside world. Either callback can be NULL:
+ * files are then opened with open(2), and messages printed on stdout and
+ * stderr.
+ */
+typedef struct
+{
+  /* opens a file named in the arguments: returns a file descriptor, or
+   * -1 with errno set */
+  int          (*open)(void* ctx, const char* fname, int flags, mode_t mode);
+  /* text as it would be printed, not necessarily whole lines */
+  void         (*log)(void* ctx, int level, const char* msg);
+  void*        ctx;
+} t_abootimg_io;
+
+
+typedef struct
+{
+  unsigned long long bytes_read;      /* from the image and components */
+  unsigned long long bytes_written;   /* to the image or extracted files */
+} t_abootimg_stats;
+
+
+/*
+ * Returns a new handle, or NULL if out of memory.
+ */
+t_abootimg* abootimg_new(const t_abootimg_io* io);
+
+void abootimg_free(t_abootimg* img);
+
+/*
+ * Sets up the handle from a command line, in the same form as for the
+ * abootimg command (argv[0] is ignored). The handle keeps pointers into
+ * argv. Returns the command, cmd_none for bad arguments, or an error.
+ */
+int abootimg_parse_args(t_abootimg* img, int argc, char** argv);
+
+/*
+ * Runs the command. A handle runs a single command.
+ */
+int abootimg_run(t_abootimg* img, enum abootimg_command cmd);
+
+/*
+ * Optional first half of abootimg_run for -u and --create: reads the
+ * configuration and the components, so that abootimg_hash_ids can hash
+ * the ids of several images at once. abootimg_run then writes the image,
+ * unless this failed.
+ */
+int abootimg_prepare(t_abootimg* img, enum abootimg_command cmd);
+
+/*
+ * Computes the SHA-1 ids of the images of prepared handles together, one
+ * image per SIMD lane (see minicript/sha_mb.h), instead of each image
+ * hashing its own while it is written.
+ */
+void abootimg_hash_ids(t_abootimg** imgs, int n);
+
+/*
+ * Message and errno (0 if not from a system call) of the last error.
+ */
+const char* abootimg_strerror(const t_abootimg* img);
+int abootimg_errno(const t_abootimg* img);
+
+/*
+ * Bytes the command read and wrote so far.
+ */
+void abootimg_get_stats(const t_abootimg* img, t_abootimg_stats* stats);
+
+#endif // LIBABOOTIMG_H_
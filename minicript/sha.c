@@ -25,20 +25,23 @@
 ** ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
-// Optimized for minimal code size.
+// The portable transform is optimized for minimal code size; whole 64-byte
+// blocks are transformed straight from the caller's buffer. On x86 a SIMD
+// or SHA-NI block function is selected at startup (see sha_x86.c).
 
 #include "sha.h"
+#include "sha_x86.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 
 #define rol(bits, value) (((value) << (bits)) | ((value) >> (32 - (bits))))
 
-static void SHA1_Transform(SHA_CTX* ctx) {
+static void SHA1_Transform(uint32_t* state, const uint8_t* p) {
     uint32_t W[80];
     uint32_t A, B, C, D, E;
-    uint8_t* p = ctx->buf;
     int t;
 
     for(t = 0; t < 16; ++t) {
@@ -53,11 +56,11 @@ static void SHA1_Transform(SHA_CTX* ctx) {
         W[t] = rol(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
     }
 
-    A = ctx->state[0];
-    B = ctx->state[1];
-    C = ctx->state[2];
-    D = ctx->state[3];
-    E = ctx->state[4];
+    A = state[0];
+    B = state[1];
+    C = state[2];
+    D = state[3];
+    E = state[4];
 
     for(t = 0; t < 80; t++) {
         uint32_t tmp = rol(5,A) + E + W[t];
@@ -78,11 +81,84 @@ static void SHA1_Transform(SHA_CTX* ctx) {
         A = tmp;
     }
 
-    ctx->state[0] += A;
-    ctx->state[1] += B;
-    ctx->state[2] += C;
-    ctx->state[3] += D;
-    ctx->state[4] += E;
+    state[0] += A;
+    state[1] += B;
+    state[2] += C;
+    state[3] += D;
+    state[4] += E;
+}
+
+static void SHA1_blocks_c(uint32_t* state, const uint8_t* p, int nblocks) {
+    while (nblocks-- > 0) {
+        SHA1_Transform(state, p);
+        p += 64;
+    }
+}
+
+typedef struct {
+    const char* name;
+    unsigned required;  // x86_cpu_features() bits
+    void (*blocks)(uint32_t* state, const uint8_t* p, int nblocks);
+} SHA1_BACKEND;
+
+// in order of preference
+static const SHA1_BACKEND SHA1_BACKENDS[] = {
+#ifdef HAVE_SHA_X86
+    { "shani", X86_SHA | X86_SSE41 | X86_SSSE3, SHA1_blocks_shani },
+    { "avx2", X86_AVX2 | X86_BMI2 | X86_SSSE3, SHA1_blocks_avx2 },
+    { "ssse3", X86_SSSE3, SHA1_blocks_ssse3 },
+#endif
+    { "c", 0, SHA1_blocks_c },
+};
+
+#define SHA1_NBACKENDS ((int)(sizeof(SHA1_BACKENDS) / sizeof(SHA1_BACKENDS[0])))
+
+static const SHA1_BACKEND* sha1_backend = &SHA1_BACKENDS[SHA1_NBACKENDS - 1];
+
+static int SHA1_supported(const SHA1_BACKEND* b) {
+#ifdef HAVE_SHA_X86
+    return (x86_cpu_features() & b->required) == b->required;
+#else
+    return b->required == 0;
+#endif
+}
+
+// Runs before main(), so the pointer is never written while hashing.
+__attribute__((constructor))
+static void SHA1_select_backend(void) {
+    int i;
+    for (i = 0; i < SHA1_NBACKENDS; i++) {
+        if (SHA1_supported(&SHA1_BACKENDS[i])) {
+            sha1_backend = &SHA1_BACKENDS[i];
+            return;
+        }
+    }
+}
+
+const char* SHA_backend(void) {
+    return sha1_backend->name;
+}
+
+const char* SHA_backend_list(int i) {
+    int n;
+    for (n = 0; n < SHA1_NBACKENDS; n++) {
+        if (SHA1_supported(&SHA1_BACKENDS[n]) && i-- == 0)
+            return SHA1_BACKENDS[n].name;
+    }
+    return NULL;
+}
+
+int SHA_set_backend(const char* name) {
+    int i;
+    for (i = 0; i < SHA1_NBACKENDS; i++) {
+        if (!strcmp(SHA1_BACKENDS[i].name, name)) {
+            if (!SHA1_supported(&SHA1_BACKENDS[i]))
+                return -1;
+            sha1_backend = &SHA1_BACKENDS[i];
+            return 0;
+        }
+    }
+    return -1;
 }
 
 static const HASH_VTAB SHA_VTAB = {
@@ -108,15 +184,33 @@ void SHA_update(SHA_CTX* ctx, const void* data, int len) {
     int i = (int) (ctx->count & 63);
     const uint8_t* p = (const uint8_t*)data;
 
+    if (len <= 0)
+        return;
+
     ctx->count += len;
 
-    while (len--) {
-        ctx->buf[i++] = *p++;
-        if (i == 64) {
-            SHA1_Transform(ctx);
-            i = 0;
-        }
+    // complete a partially filled block first
+    if (i) {
+        int n = 64 - i;
+        if (n > len)
+            n = len;
+        memcpy(ctx->buf + i, p, n);
+        p += n;
+        len -= n;
+        if (i + n < 64)
+            return;
+        sha1_backend->blocks(ctx->state, ctx->buf, 1);
     }
+
+    // block functions use unaligned loads, so the caller's buffer
+    // does not need to be aligned
+    if (len >= 64) {
+        sha1_backend->blocks(ctx->state, p, len / 64);
+        p += len & ~63;
+        len &= 63;
+    }
+
+    memcpy(ctx->buf, p, len);
 }
 
 
@@ -153,3 +247,103 @@ const uint8_t* SHA_hash(const void* data, int len, uint8_t* digest) {
     memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
     return digest;
 }
+
+
+/*
+ * Backend self-test: known answers first, then every supported block
+ * function is cross-checked against the portable one on pseudo-random
+ * messages of every length up to a few blocks, at odd alignments.
+ */
+
+// Pads msg into out (which must hold len + 72 bytes), returns block count.
+static int SHA1_pad(const uint8_t* msg, int len, uint8_t* out) {
+    uint64_t bits = (uint64_t)len * 8;
+    int total = (len + 8) / 64 * 64 + 64;
+    int i;
+
+    memcpy(out, msg, len);
+    out[len] = 0x80;
+    memset(out + len + 1, 0, total - len - 1);
+    for (i = 0; i < 8; i++)
+        out[total - 1 - i] = (uint8_t)(bits >> (8 * i));
+    return total / 64;
+}
+
+static void SHA1_digest_with(const SHA1_BACKEND* b, const uint8_t* msg,
+                             int len, uint8_t* pad, uint8_t* digest) {
+    uint32_t state[5] = {
+        0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+    };
+    int i;
+
+    b->blocks(state, pad, SHA1_pad(msg, len, pad));
+    for (i = 0; i < 5; i++) {
+        digest[4 * i + 0] = state[i] >> 24;
+        digest[4 * i + 1] = state[i] >> 16;
+        digest[4 * i + 2] = state[i] >> 8;
+        digest[4 * i + 3] = state[i];
+    }
+}
+
+int SHA_selftest(void) {
+    static const struct {
+        const char* msg;
+        const char* digest;
+    } kat[] = {
+        { "", "\xda\x39\xa3\xee\x5e\x6b\x4b\x0d\x32\x55"
+              "\xbf\xef\x95\x60\x18\x90\xaf\xd8\x07\x09" },
+        { "abc", "\xa9\x99\x3e\x36\x47\x06\x81\x6a\xba\x3e"
+                 "\x25\x71\x78\x50\xc2\x6c\x9c\xd0\xd8\x9d" },
+        { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+          "\x84\x98\x3e\x44\x1c\x3b\xd2\x6e\xba\xae"
+          "\x4a\xa1\xf9\x51\x29\xe5\xe5\x46\x70\xf1" },
+    };
+    enum { MAXLEN = 4 * 64 + 3 };
+    uint8_t* msg = malloc(MAXLEN + 1);
+    uint8_t* pad = malloc(MAXLEN + 72 + 3);
+    uint8_t ref[SHA_DIGEST_SIZE];
+    uint8_t digest[SHA_DIGEST_SIZE];
+    uint32_t seed = 0x2545F491;
+    int failed = 0;
+    int i, b, len;
+
+    if (!msg || !pad) {
+        free(msg);
+        free(pad);
+        return -1;
+    }
+    for (i = 0; i <= MAXLEN; i++) {
+        seed = seed * 1103515245 + 12345;
+        msg[i] = seed >> 16;
+    }
+
+    for (b = 0; b < SHA1_NBACKENDS; b++) {
+        const SHA1_BACKEND* be = &SHA1_BACKENDS[b];
+        if (!SHA1_supported(be))
+            continue;
+
+        for (i = 0; i < (int)(sizeof(kat) / sizeof(kat[0])); i++) {
+            SHA1_digest_with(be, (const uint8_t*)kat[i].msg,
+                             strlen(kat[i].msg), pad, digest);
+            if (memcmp(digest, kat[i].digest, SHA_DIGEST_SIZE)) {
+                fprintf(stderr, "sha1 %s: known answer %d failed\n", be->name, i);
+                failed = 1;
+            }
+        }
+
+        for (len = 0; len < MAXLEN; len++) {
+            const uint8_t* m = msg + (len & 1);
+            SHA1_digest_with(&SHA1_BACKENDS[SHA1_NBACKENDS - 1], m, len, pad, ref);
+            SHA1_digest_with(be, m, len, pad + (len & 3), digest);
+            if (memcmp(digest, ref, SHA_DIGEST_SIZE)) {
+                fprintf(stderr, "sha1 %s: mismatch for %d bytes\n", be->name, len);
+                failed = 1;
+                break;
+            }
+        }
+    }
+
+    free(msg);
+    free(pad);
+    return failed ? -1 : 0;
+}
@@ -45,6 +45,21 @@ const uint8_t* SHA_hash(const void* data, int len, uint8_t* digest);
 
 #define SHA_DIGEST_SIZE 20
 
+// Name of the block function in use. The fastest one supported by the
+// CPU is selected at startup.
+const char* SHA_backend(void);
+
+// Name of the i-th backend supported by this CPU, NULL past the last one.
+const char* SHA_backend_list(int i);
+
+// Forces a backend (for benchmarks). Returns -1 if it is unknown or not
+// supported by this CPU.
+int SHA_set_backend(const char* name);
+
+// Checks every supported backend against known answers and against the
+// portable implementation. Returns 0 on success.
+int SHA_selftest(void);
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus
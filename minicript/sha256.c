@@ -0,0 +1,376 @@
+/* sha256.c
+**
+** Copyright 2013, The Android Open Source Project
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**     * Redistributions of source code must retain the above copyright
+**       notice, this list of conditions and the following disclaimer.
+**     * Redistributions in binary form must reproduce the above copyright
+**       notice, this list of conditions and the following disclaimer in the
+**       documentation and/or other materials provided with the distribution.
+**     * Neither the name of Google Inc. nor the names of its contributors may
+**       be used to endorse or promote products derived from this software
+**       without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY Google Inc. ``AS IS'' AND ANY EXPRESS OR
+** IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+** MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+** EVENT SHALL Google Inc. BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+** SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+** PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+** OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+** WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+** OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+** ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// The portable transform is optimized for minimal code size. On x86 an
+// AVX2 or SHA-NI block function is selected at startup (see sha_x86.c).
+
+#include "sha256.h"
+#include "sha_x86.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// a.k.a. right rotation
+#define ror(value, bits) (((value) >> (bits)) | ((value) << (32 - (bits))))
+#define shr(value, bits) ((value) >> (bits))
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+static void SHA256_Transform(uint32_t* state, const uint8_t* p) {
+    uint32_t W[64];
+    uint32_t A, B, C, D, E, F, G, H;
+    int t;
+
+    for(t = 0; t < 16; ++t) {
+        uint32_t tmp =  *p++ << 24;
+        tmp |= *p++ << 16;
+        tmp |= *p++ << 8;
+        tmp |= *p++;
+        W[t] = tmp;
+    }
+
+    for (; t < 64; t++) {
+        uint32_t s0 = ror(W[t-15], 7) ^ ror(W[t-15], 18) ^ shr(W[t-15], 3);
+        uint32_t s1 = ror(W[t-2], 17) ^ ror(W[t-2], 19) ^ shr(W[t-2], 10);
+        W[t] = W[t-16] + s0 + W[t-7] + s1;
+    }
+
+    A = state[0];
+    B = state[1];
+    C = state[2];
+    D = state[3];
+    E = state[4];
+    F = state[5];
+    G = state[6];
+    H = state[7];
+
+    for (t = 0; t < 64; t++) {
+        uint32_t s0 = ror(A, 2) ^ ror(A, 13) ^ ror(A, 22);
+        uint32_t maj = (A & B) ^ (A & C) ^ (B & C);
+        uint32_t t2 = s0 + maj;
+        uint32_t s1 = ror(E, 6) ^ ror(E, 11) ^ ror(E, 25);
+        uint32_t ch = (E & F) ^ ((~E) & G);
+        uint32_t t1 = H + s1 + ch + K[t] + W[t];
+
+        H = G;
+        G = F;
+        F = E;
+        E = D + t1;
+        D = C;
+        C = B;
+        B = A;
+        A = t1 + t2;
+    }
+
+    state[0] += A;
+    state[1] += B;
+    state[2] += C;
+    state[3] += D;
+    state[4] += E;
+    state[5] += F;
+    state[6] += G;
+    state[7] += H;
+}
+
+static void SHA256_blocks_c(uint32_t* state, const uint8_t* p, int nblocks) {
+    while (nblocks-- > 0) {
+        SHA256_Transform(state, p);
+        p += 64;
+    }
+}
+
+typedef struct {
+    const char* name;
+    unsigned required;  // x86_cpu_features() bits
+    void (*blocks)(uint32_t* state, const uint8_t* p, int nblocks);
+} SHA256_BACKEND;
+
+// in order of preference
+static const SHA256_BACKEND SHA256_BACKENDS[] = {
+#ifdef HAVE_SHA_X86
+    { "shani", X86_SHA | X86_SSE41 | X86_SSSE3, SHA256_blocks_shani },
+    { "avx2", X86_AVX2 | X86_BMI2 | X86_SSSE3, SHA256_blocks_avx2 },
+#endif
+    { "c", 0, SHA256_blocks_c },
+};
+
+#define SHA256_NBACKENDS ((int)(sizeof(SHA256_BACKENDS) / sizeof(SHA256_BACKENDS[0])))
+
+static const SHA256_BACKEND* sha256_backend = &SHA256_BACKENDS[SHA256_NBACKENDS - 1];
+
+static int SHA256_supported(const SHA256_BACKEND* b) {
+#ifdef HAVE_SHA_X86
+    return (x86_cpu_features() & b->required) == b->required;
+#else
+    return b->required == 0;
+#endif
+}
+
+// Runs before main(), so the pointer is never written while hashing.
+__attribute__((constructor))
+static void SHA256_select_backend(void) {
+    int i;
+    for (i = 0; i < SHA256_NBACKENDS; i++) {
+        if (SHA256_supported(&SHA256_BACKENDS[i])) {
+            sha256_backend = &SHA256_BACKENDS[i];
+            return;
+        }
+    }
+}
+
+const char* SHA256_backend(void) {
+    return sha256_backend->name;
+}
+
+const char* SHA256_backend_list(int i) {
+    int n;
+    for (n = 0; n < SHA256_NBACKENDS; n++) {
+        if (SHA256_supported(&SHA256_BACKENDS[n]) && i-- == 0)
+            return SHA256_BACKENDS[n].name;
+    }
+    return NULL;
+}
+
+int SHA256_set_backend(const char* name) {
+    int i;
+    for (i = 0; i < SHA256_NBACKENDS; i++) {
+        if (!strcmp(SHA256_BACKENDS[i].name, name)) {
+            if (!SHA256_supported(&SHA256_BACKENDS[i]))
+                return -1;
+            sha256_backend = &SHA256_BACKENDS[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static const HASH_VTAB SHA256_VTAB = {
+    SHA256_init,
+    SHA256_update,
+    SHA256_final,
+    SHA256_hash,
+    SHA256_DIGEST_SIZE
+};
+
+void SHA256_init(SHA256_CTX* ctx) {
+    ctx->f = &SHA256_VTAB;
+    ctx->state[0] = 0x6a09e667;
+    ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372;
+    ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f;
+    ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab;
+    ctx->state[7] = 0x5be0cd19;
+    ctx->count = 0;
+}
+
+
+void SHA256_update(SHA256_CTX* ctx, const void* data, int len) {
+    int i = (int) (ctx->count & 63);
+    const uint8_t* p = (const uint8_t*)data;
+
+    if (len <= 0)
+        return;
+
+    ctx->count += len;
+
+    // complete a partially filled block first
+    if (i) {
+        int n = 64 - i;
+        if (n > len)
+            n = len;
+        memcpy(ctx->buf + i, p, n);
+        p += n;
+        len -= n;
+        if (i + n < 64)
+            return;
+        sha256_backend->blocks(ctx->state, ctx->buf, 1);
+    }
+
+    // block functions use unaligned loads, so the caller's buffer
+    // does not need to be aligned
+    if (len >= 64) {
+        sha256_backend->blocks(ctx->state, p, len / 64);
+        p += len & ~63;
+        len &= 63;
+    }
+
+    memcpy(ctx->buf, p, len);
+}
+
+
+const uint8_t* SHA256_final(SHA256_CTX* ctx) {
+    uint8_t *p = ctx->buf;
+    uint64_t cnt = ctx->count * 8;
+    int i;
+
+    SHA256_update(ctx, (uint8_t*)"\x80", 1);
+    while ((ctx->count & 63) != 56) {
+        SHA256_update(ctx, (uint8_t*)"\0", 1);
+    }
+    for (i = 0; i < 8; ++i) {
+        uint8_t tmp = (uint8_t) (cnt >> ((7 - i) * 8));
+        SHA256_update(ctx, &tmp, 1);
+    }
+
+    for (i = 0; i < 8; i++) {
+        uint32_t tmp = ctx->state[i];
+        *p++ = tmp >> 24;
+        *p++ = tmp >> 16;
+        *p++ = tmp >> 8;
+        *p++ = tmp >> 0;
+    }
+
+    return ctx->buf;
+}
+
+/* Convenience function */
+const uint8_t* SHA256_hash(const void* data, int len, uint8_t* digest) {
+    SHA256_CTX ctx;
+    SHA256_init(&ctx);
+    SHA256_update(&ctx, data, len);
+    memcpy(digest, SHA256_final(&ctx), SHA256_DIGEST_SIZE);
+    return digest;
+}
+
+
+/*
+ * Backend self-test, same scheme as SHA_selftest().
+ */
+
+// Pads msg into out (which must hold len + 72 bytes), returns block count.
+static int SHA256_pad(const uint8_t* msg, int len, uint8_t* out) {
+    uint64_t bits = (uint64_t)len * 8;
+    int total = (len + 8) / 64 * 64 + 64;
+    int i;
+
+    memcpy(out, msg, len);
+    out[len] = 0x80;
+    memset(out + len + 1, 0, total - len - 1);
+    for (i = 0; i < 8; i++)
+        out[total - 1 - i] = (uint8_t)(bits >> (8 * i));
+    return total / 64;
+}
+
+static void SHA256_digest_with(const SHA256_BACKEND* b, const uint8_t* msg,
+                               int len, uint8_t* pad, uint8_t* digest) {
+    uint32_t state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    int i;
+
+    b->blocks(state, pad, SHA256_pad(msg, len, pad));
+    for (i = 0; i < 8; i++) {
+        digest[4 * i + 0] = state[i] >> 24;
+        digest[4 * i + 1] = state[i] >> 16;
+        digest[4 * i + 2] = state[i] >> 8;
+        digest[4 * i + 3] = state[i];
+    }
+}
+
+int SHA256_selftest(void) {
+    static const struct {
+        const char* msg;
+        const char* digest;
+    } kat[] = {
+        { "", "\xe3\xb0\xc4\x42\x98\xfc\x1c\x14\x9a\xfb\xf4\xc8\x99\x6f\xb9\x24"
+              "\x27\xae\x41\xe4\x64\x9b\x93\x4c\xa4\x95\x99\x1b\x78\x52\xb8\x55" },
+        { "abc", "\xba\x78\x16\xbf\x8f\x01\xcf\xea\x41\x41\x40\xde\x5d\xae\x22\x23"
+                 "\xb0\x03\x61\xa3\x96\x17\x7a\x9c\xb4\x10\xff\x61\xf2\x00\x15\xad" },
+        { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+          "\x24\x8d\x6a\x61\xd2\x06\x38\xb8\xe5\xc0\x26\x93\x0c\x3e\x60\x39"
+          "\xa3\x3c\xe4\x59\x64\xff\x21\x67\xf6\xec\xed\xd4\x19\xdb\x06\xc1" },
+    };
+    enum { MAXLEN = 4 * 64 + 3 };
+    uint8_t* msg = malloc(MAXLEN + 1);
+    uint8_t* pad = malloc(MAXLEN + 72 + 3);
+    uint8_t ref[SHA256_DIGEST_SIZE];
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint32_t seed = 0x2545F491;
+    int failed = 0;
+    int i, b, len;
+
+    if (!msg || !pad) {
+        free(msg);
+        free(pad);
+        return -1;
+    }
+    for (i = 0; i <= MAXLEN; i++) {
+        seed = seed * 1103515245 + 12345;
+        msg[i] = seed >> 16;
+    }
+
+    for (b = 0; b < SHA256_NBACKENDS; b++) {
+        const SHA256_BACKEND* be = &SHA256_BACKENDS[b];
+        if (!SHA256_supported(be))
+            continue;
+
+        for (i = 0; i < (int)(sizeof(kat) / sizeof(kat[0])); i++) {
+            SHA256_digest_with(be, (const uint8_t*)kat[i].msg,
+                               strlen(kat[i].msg), pad, digest);
+            if (memcmp(digest, kat[i].digest, SHA256_DIGEST_SIZE)) {
+                fprintf(stderr, "sha256 %s: known answer %d failed\n", be->name, i);
+                failed = 1;
+            }
+        }
+
+        for (len = 0; len < MAXLEN; len++) {
+            const uint8_t* m = msg + (len & 1);
+            SHA256_digest_with(&SHA256_BACKENDS[SHA256_NBACKENDS - 1], m, len, pad, ref);
+            SHA256_digest_with(be, m, len, pad + (len & 3), digest);
+            if (memcmp(digest, ref, SHA256_DIGEST_SIZE)) {
+                fprintf(stderr, "sha256 %s: mismatch for %d bytes\n", be->name, len);
+                failed = 1;
+                break;
+            }
+        }
+    }
+
+    free(msg);
+    free(pad);
+    return failed ? -1 : 0;
+}
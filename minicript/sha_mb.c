@@ -0,0 +1,238 @@
+/* sha_mb.c
+**
+** Multi-buffer SHA-1. Each SIMD lane hashes its own message; a small
+** scheduler feeds every lane its next 64-byte block (pointing straight
+** into the caller's data when a whole block is contiguous) and refills a
+** lane with the next job when its message is done.
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+*/
+
+#include "sha_mb.h"
+#include "sha_x86.h"
+
+#include <string.h>
+
+#define MB_MAX_LANES 8
+
+#ifdef HAVE_SHA_X86
+#define MB_LANES    4
+#define MB_VEC      mb_vec4
+#define MB_NAME     SHA1_mb_transform_sse2
+#define MB_TARGET   __attribute__((target("sse2")))
+#include "sha_mb_transform.h"
+#undef MB_LANES
+#undef MB_VEC
+#undef MB_NAME
+#undef MB_TARGET
+
+#define MB_LANES    8
+#define MB_VEC      mb_vec8
+#define MB_NAME     SHA1_mb_transform_avx2
+#define MB_TARGET   __attribute__((target("avx2")))
+#include "sha_mb_transform.h"
+#undef MB_LANES
+#undef MB_VEC
+#undef MB_NAME
+#undef MB_TARGET
+#endif
+
+typedef struct {
+    const char* name;
+    unsigned required;  // x86_cpu_features() bits
+    int lanes;          // 0: one message after the other with SHA_update
+    void (*transform)(uint32_t* state, const uint8_t* const* blocks);
+} SHA_MB_BACKEND;
+
+// in order of preference; one SHA-NI stream beats eight AVX2 lanes
+static const SHA_MB_BACKEND SHA_MB_BACKENDS[] = {
+#ifdef HAVE_SHA_X86
+    { "serial", X86_SHA | X86_SSE41 | X86_SSSE3, 0, NULL },
+    { "avx2", X86_AVX2, 8, SHA1_mb_transform_avx2 },
+    { "sse2", 0, 4, SHA1_mb_transform_sse2 },
+#endif
+    { "serial", 0, 0, NULL },
+};
+
+#define SHA_MB_NBACKENDS ((int)(sizeof(SHA_MB_BACKENDS) / sizeof(SHA_MB_BACKENDS[0])))
+
+static const SHA_MB_BACKEND* mb_backend = &SHA_MB_BACKENDS[SHA_MB_NBACKENDS - 1];
+
+static int SHA_mb_supported(const SHA_MB_BACKEND* b) {
+#ifdef HAVE_SHA_X86
+    return (x86_cpu_features() & b->required) == b->required;
+#else
+    return b->required == 0;
+#endif
+}
+
+__attribute__((constructor))
+static void SHA_mb_select_backend(void) {
+    int i;
+    for (i = 0; i < SHA_MB_NBACKENDS; i++) {
+        if (SHA_mb_supported(&SHA_MB_BACKENDS[i])) {
+            mb_backend = &SHA_MB_BACKENDS[i];
+            return;
+        }
+    }
+}
+
+const char* SHA_mb_backend(void) {
+    return mb_backend->name;
+}
+
+int SHA_mb_lanes(void) {
+    return mb_backend->lanes ? mb_backend->lanes : 1;
+}
+
+int SHA_mb_set_backend(const char* name) {
+    int i;
+    for (i = 0; i < SHA_MB_NBACKENDS; i++) {
+        if (!strcmp(SHA_MB_BACKENDS[i].name, name) &&
+            SHA_mb_supported(&SHA_MB_BACKENDS[i])) {
+            mb_backend = &SHA_MB_BACKENDS[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+typedef struct {
+    SHA_MB_JOB* job;    // NULL when the lane is idle
+    int seg;            // current segment
+    int off;            // offset in the current segment
+    uint64_t total;     // message length in bytes
+    int pad;            // 0: data, 1: 0x80 emitted, 2: length emitted
+    uint8_t block[64];  // staging for blocks spanning segments or padding
+} SHA_MB_LANE;
+
+static void SHA_mb_start(SHA_MB_LANE* lane, SHA_MB_JOB* job,
+                         uint32_t* state, int nlanes, int l) {
+    static const uint32_t iv[5] = {
+        0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+    };
+    int i;
+
+    lane->job = job;
+    lane->seg = 0;
+    lane->off = 0;
+    lane->total = 0;
+    lane->pad = 0;
+    for (i = 0; i < job->nsegs; i++)
+        lane->total += job->segs[i].len;
+    for (i = 0; i < 5; i++)
+        state[i * nlanes + l] = iv[i];
+}
+
+// Next block of the lane's padded message, NULL once it is complete.
+static const uint8_t* SHA_mb_next_block(SHA_MB_LANE* lane) {
+    const SHA_MB_JOB* job = lane->job;
+    int fill = 0;
+
+    if (lane->pad == 2)
+        return NULL;
+
+    if (lane->pad == 0) {
+        while (lane->seg < job->nsegs) {
+            const SHA_MB_SEG* s = &job->segs[lane->seg];
+            int left = s->len - lane->off;
+            if (fill == 0 && left >= 64) {
+                const uint8_t* p = (const uint8_t*)s->data + lane->off;
+                lane->off += 64;
+                return p;
+            }
+            if (left > 64 - fill)
+                left = 64 - fill;
+            memcpy(lane->block + fill, (const uint8_t*)s->data + lane->off, left);
+            fill += left;
+            lane->off += left;
+            if (lane->off == s->len) {
+                lane->seg++;
+                lane->off = 0;
+            }
+            if (fill == 64)
+                return lane->block;
+        }
+        lane->block[fill++] = 0x80;
+        lane->pad = 1;
+    }
+
+    memset(lane->block + fill, 0, 64 - fill);
+    if (fill <= 56) {
+        uint64_t bits = lane->total * 8;
+        int i;
+        for (i = 0; i < 8; i++)
+            lane->block[63 - i] = (uint8_t)(bits >> (8 * i));
+        lane->pad = 2;
+    }
+    return lane->block;
+}
+
+static void SHA_mb_serial(SHA_MB_JOB* jobs, int njobs) {
+    SHA_CTX ctx;
+    int i, j;
+
+    for (i = 0; i < njobs; i++) {
+        SHA_init(&ctx);
+        for (j = 0; j < jobs[i].nsegs; j++)
+            SHA_update(&ctx, jobs[i].segs[j].data, jobs[i].segs[j].len);
+        memcpy(jobs[i].digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+    }
+}
+
+void SHA_mb_hash(SHA_MB_JOB* jobs, int njobs) {
+    static const uint8_t idle[64];
+    SHA_MB_LANE lanes[MB_MAX_LANES];
+    uint32_t state[5 * MB_MAX_LANES];
+    const uint8_t* blocks[MB_MAX_LANES];
+    const SHA_MB_BACKEND* be = mb_backend;
+    int nlanes = be->lanes;
+    int next = 0;
+    int l, i;
+
+    // a block of every lane costs about as much as blocks of half as many
+    // messages hashed one after the other: with fewer jobs, serial wins
+    if (!nlanes || (njobs < nlanes / 2)) {
+        SHA_mb_serial(jobs, njobs);
+        return;
+    }
+
+    for (l = 0; l < nlanes; l++)
+        lanes[l].job = NULL;
+
+    for (;;) {
+        int active = 0;
+
+        for (l = 0; l < nlanes; l++) {
+            SHA_MB_LANE* lane = &lanes[l];
+            const uint8_t* p = lane->job ? SHA_mb_next_block(lane) : NULL;
+
+            if (!p && lane->job) {
+                for (i = 0; i < 5; i++) {
+                    uint32_t v = state[i * nlanes + l];
+                    lane->job->digest[4 * i + 0] = v >> 24;
+                    lane->job->digest[4 * i + 1] = v >> 16;
+                    lane->job->digest[4 * i + 2] = v >> 8;
+                    lane->job->digest[4 * i + 3] = v;
+                }
+                lane->job = NULL;
+            }
+            if (!p && next < njobs) {
+                SHA_mb_start(lane, &jobs[next++], state, nlanes, l);
+                p = SHA_mb_next_block(lane);
+            }
+
+            if (p)
+                active++;
+            blocks[l] = p ? p : idle;
+        }
+
+        if (!active)
+            break;
+        be->transform(state, blocks);
+    }
+}
@@ -0,0 +1,51 @@
+/* sha_mb.h
+**
+** Multi-buffer SHA-1: hashes many independent messages at once, one
+** message per SIMD lane.
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+*/
+
+#ifndef MINICRIPT_SHA_MB_H_
+#define MINICRIPT_SHA_MB_H_
+
+#include <stdint.h>
+#include "sha.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+// One piece of a message; a message is the concatenation of its segments.
+typedef struct SHA_MB_SEG {
+    const void* data;
+    int len;
+} SHA_MB_SEG;
+
+typedef struct SHA_MB_JOB {
+    const SHA_MB_SEG* segs;
+    int nsegs;
+    uint8_t digest[SHA_DIGEST_SIZE];  // filled by SHA_mb_hash
+} SHA_MB_JOB;
+
+// Hashes every job. Up to SHA_mb_lanes() jobs are advanced together;
+// a lane picks up the next job as soon as its message is finished. Fewer
+// jobs than half the lanes are hashed one after the other.
+void SHA_mb_hash(SHA_MB_JOB* jobs, int njobs);
+
+// Lane engine selected at startup ("avx2", "sse2" or "serial").
+const char* SHA_mb_backend(void);
+int SHA_mb_lanes(void);
+
+// Forces a lane engine (for benchmarks). Returns -1 if unknown or not
+// supported by this CPU.
+int SHA_mb_set_backend(const char* name);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif  // MINICRIPT_SHA_MB_H_
@@ -0,0 +1,93 @@
+/* sha_mb_transform.h
+**
+** Lane-parallel SHA-1 transform, written with GCC vector extensions.
+** Included once per vector width by sha_mb.c, with:
+**   MB_LANES   number of 32-bit lanes
+**   MB_VEC     name of the vector type to declare
+**   MB_NAME    function name
+**   MB_TARGET  target attribute
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+*/
+
+typedef uint32_t MB_VEC __attribute__((vector_size(4 * MB_LANES)));
+
+#define MB_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define MB_ROUND(f, k) \
+    tmp = MB_ROL(A, 5) + (f) + E + W[t & 15] + (k); \
+    E = D; \
+    D = C; \
+    C = MB_ROL(B, 30); \
+    B = A; \
+    A = tmp;
+
+#define MB_SCHEDULE \
+    W[t & 15] = MB_ROL(W[(t - 3) & 15] ^ W[(t - 8) & 15] ^ \
+                       W[(t - 14) & 15] ^ W[t & 15], 1);
+
+/*
+ * state holds the five chaining words lane-interleaved (state[i * MB_LANES
+ * + lane]); blocks[lane] points to the lane's next 64-byte block.
+ */
+MB_TARGET
+static void MB_NAME(uint32_t* state, const uint8_t* const* blocks) {
+    MB_VEC W[16];
+    MB_VEC A, B, C, D, E, tmp;
+    MB_VEC S[5];
+    uint32_t w[MB_LANES];
+    int t, l;
+
+    for (t = 0; t < 16; t++) {
+        for (l = 0; l < MB_LANES; l++) {
+            memcpy(&w[l], blocks[l] + 4 * t, 4);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            w[l] = __builtin_bswap32(w[l]);
+#endif
+        }
+        memcpy(&W[t], w, sizeof(w));
+    }
+    for (t = 0; t < 5; t++)
+        memcpy(&S[t], state + t * MB_LANES, sizeof(MB_VEC));
+
+    A = S[0];
+    B = S[1];
+    C = S[2];
+    D = S[3];
+    E = S[4];
+
+    for (t = 0; t < 16; t++) {
+        MB_ROUND(D ^ (B & (C ^ D)), 0x5A827999)
+    }
+    for (; t < 20; t++) {
+        MB_SCHEDULE
+        MB_ROUND(D ^ (B & (C ^ D)), 0x5A827999)
+    }
+    for (; t < 40; t++) {
+        MB_SCHEDULE
+        MB_ROUND(B ^ C ^ D, 0x6ED9EBA1)
+    }
+    for (; t < 60; t++) {
+        MB_SCHEDULE
+        MB_ROUND((B & C) | (D & (B | C)), 0x8F1BBCDC)
+    }
+    for (; t < 80; t++) {
+        MB_SCHEDULE
+        MB_ROUND(B ^ C ^ D, 0xCA62C1D6)
+    }
+
+    S[0] += A;
+    S[1] += B;
+    S[2] += C;
+    S[3] += D;
+    S[4] += E;
+    for (t = 0; t < 5; t++)
+        memcpy(state + t * MB_LANES, &S[t], sizeof(MB_VEC));
+}
+
+#undef MB_ROL
+#undef MB_ROUND
+#undef MB_SCHEDULE
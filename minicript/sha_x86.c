@@ -0,0 +1,447 @@
+/* sha_x86.c
+**
+** SHA-1 and SHA-256 block functions using x86 SIMD extensions:
+**   - SSSE3: vectorized message schedule, unrolled scalar rounds (SHA-1)
+**   - AVX2:  same code built for AVX2/BMI2 (VEX encoding, rorx)
+**   - SHA:   Intel SHA extensions (SHA-NI)
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+*/
+
+#include "sha_x86.h"
+
+#ifdef HAVE_SHA_X86
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define rol(bits, value) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+
+static uint64_t xgetbv0(void) {
+    uint32_t lo, hi;
+    __asm__ volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+unsigned x86_cpu_features(void) {
+    static unsigned features = ~0u;
+    unsigned eax, ebx, ecx, edx;
+    unsigned f = 0;
+
+    if (features != ~0u)
+        return features;
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        if (ecx & bit_SSSE3)
+            f |= X86_SSSE3;
+        if (ecx & bit_SSE4_1)
+            f |= X86_SSE41;
+        // AVX state must be enabled by the OS as well
+        int avx_os = (ecx & bit_OSXSAVE) && (ecx & bit_AVX) &&
+                     ((xgetbv0() & 6) == 6);
+        if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+            if (avx_os && (ebx & bit_AVX2))
+                f |= X86_AVX2;
+            if (ebx & bit_BMI2)
+                f |= X86_BMI2;
+            if (ebx & bit_SHA)
+                f |= X86_SHA;
+        }
+    }
+
+    features = f;
+    return f;
+}
+
+
+/*
+ * SSSE3 / AVX2
+ *
+ * W[t] + K[t] is computed four words at a time. W[t+3] depends on W[t],
+ * so lane 3 is fixed up after the rotate.
+ */
+
+#define F1(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))
+#define F2(b, c, d) ((b) ^ (c) ^ (d))
+#define F3(b, c, d) (((b) & (c)) | ((d) & ((b) | (c))))
+
+#define R(a, b, c, d, e, f, t) \
+    e += rol(5, a) + f(b, c, d) + wk[t]; \
+    b = rol(30, b);
+
+#define R5(f, t) \
+    R(A, B, C, D, E, f, t + 0) \
+    R(E, A, B, C, D, f, t + 1) \
+    R(D, E, A, B, C, f, t + 2) \
+    R(C, D, E, A, B, f, t + 3) \
+    R(B, C, D, E, A, f, t + 4)
+
+#define ROL1_EPI32(x) _mm_or_si128(_mm_slli_epi32(x, 1), _mm_srli_epi32(x, 31))
+
+static inline __attribute__((always_inline, target("ssse3")))
+void sha1_simd_blocks(uint32_t* state, const uint8_t* p, int nblocks) {
+    const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+                                       4, 5, 6, 7, 0, 1, 2, 3);
+    const __m128i K[4] = {
+        _mm_set1_epi32(0x5A827999), _mm_set1_epi32(0x6ED9EBA1),
+        _mm_set1_epi32(0x8F1BBCDC), _mm_set1_epi32(0xCA62C1D6)
+    };
+    uint32_t wk[80] __attribute__((aligned(16)));
+    __m128i w[20];
+    uint32_t A, B, C, D, E;
+    int i;
+
+    while (nblocks-- > 0) {
+        for (i = 0; i < 4; i++) {
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 16 * i)), bswap);
+            _mm_store_si128((__m128i*)(wk + 4 * i), _mm_add_epi32(w[i], K[0]));
+        }
+        for (; i < 20; i++) {
+            __m128i x = _mm_xor_si128(_mm_srli_si128(w[i - 1], 4), w[i - 2]);
+            x = _mm_xor_si128(x, _mm_alignr_epi8(w[i - 3], w[i - 4], 8));
+            x = _mm_xor_si128(x, w[i - 4]);
+            x = ROL1_EPI32(x);
+            __m128i t = _mm_slli_si128(x, 12);
+            x = _mm_xor_si128(x, ROL1_EPI32(t));
+            w[i] = x;
+            _mm_store_si128((__m128i*)(wk + 4 * i), _mm_add_epi32(x, K[i / 5]));
+        }
+
+        A = state[0];
+        B = state[1];
+        C = state[2];
+        D = state[3];
+        E = state[4];
+
+        R5(F1, 0)  R5(F1, 5)  R5(F1, 10) R5(F1, 15)
+        R5(F2, 20) R5(F2, 25) R5(F2, 30) R5(F2, 35)
+        R5(F3, 40) R5(F3, 45) R5(F3, 50) R5(F3, 55)
+        R5(F2, 60) R5(F2, 65) R5(F2, 70) R5(F2, 75)
+
+        state[0] += A;
+        state[1] += B;
+        state[2] += C;
+        state[3] += D;
+        state[4] += E;
+
+        p += 64;
+    }
+}
+
+__attribute__((target("ssse3")))
+void SHA1_blocks_ssse3(uint32_t* state, const uint8_t* p, int nblocks) {
+    sha1_simd_blocks(state, p, nblocks);
+}
+
+__attribute__((target("avx2,bmi2")))
+void SHA1_blocks_avx2(uint32_t* state, const uint8_t* p, int nblocks) {
+    sha1_simd_blocks(state, p, nblocks);
+}
+
+
+/*
+ * SHA-NI
+ *
+ * Four rounds per sha1rnds4; the message schedule runs with sha1msg1/2
+ * interleaved with the rounds of the previous group.
+ */
+
+#define SHANI_ROUNDS(Ea, Eb, M0, M1, M2, M3, f) \
+    Ea = _mm_sha1nexte_epu32(Ea, M0); \
+    Eb = ABCD; \
+    M1 = _mm_sha1msg2_epu32(M1, M0); \
+    ABCD = _mm_sha1rnds4_epu32(ABCD, Ea, f); \
+    M3 = _mm_sha1msg1_epu32(M3, M0); \
+    M2 = _mm_xor_si128(M2, M0);
+
+__attribute__((target("sha,sse4.1,ssse3")))
+void SHA1_blocks_shani(uint32_t* state, const uint8_t* p, int nblocks) {
+    const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i ABCD, ABCD_SAVE, E0, E0_SAVE, E1;
+    __m128i MSG0, MSG1, MSG2, MSG3;
+
+    ABCD = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1B);
+    E0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+    while (nblocks-- > 0) {
+        ABCD_SAVE = ABCD;
+        E0_SAVE = E0;
+
+        // rounds 0-3
+        MSG0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 0)), bswap);
+        E0 = _mm_add_epi32(E0, MSG0);
+        E1 = ABCD;
+        ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+
+        // rounds 4-7
+        MSG1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 16)), bswap);
+        E1 = _mm_sha1nexte_epu32(E1, MSG1);
+        E0 = ABCD;
+        ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 0);
+        MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+
+        // rounds 8-11
+        MSG2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 32)), bswap);
+        E0 = _mm_sha1nexte_epu32(E0, MSG2);
+        E1 = ABCD;
+        ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+        MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+        MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+        // rounds 12-67
+        MSG3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 48)), bswap);
+        SHANI_ROUNDS(E1, E0, MSG3, MSG0, MSG1, MSG2, 0)
+        SHANI_ROUNDS(E0, E1, MSG0, MSG1, MSG2, MSG3, 0)
+        SHANI_ROUNDS(E1, E0, MSG1, MSG2, MSG3, MSG0, 1)
+        SHANI_ROUNDS(E0, E1, MSG2, MSG3, MSG0, MSG1, 1)
+        SHANI_ROUNDS(E1, E0, MSG3, MSG0, MSG1, MSG2, 1)
+        SHANI_ROUNDS(E0, E1, MSG0, MSG1, MSG2, MSG3, 1)
+        SHANI_ROUNDS(E1, E0, MSG1, MSG2, MSG3, MSG0, 1)
+        SHANI_ROUNDS(E0, E1, MSG2, MSG3, MSG0, MSG1, 2)
+        SHANI_ROUNDS(E1, E0, MSG3, MSG0, MSG1, MSG2, 2)
+        SHANI_ROUNDS(E0, E1, MSG0, MSG1, MSG2, MSG3, 2)
+        SHANI_ROUNDS(E1, E0, MSG1, MSG2, MSG3, MSG0, 2)
+        SHANI_ROUNDS(E0, E1, MSG2, MSG3, MSG0, MSG1, 2)
+        SHANI_ROUNDS(E1, E0, MSG3, MSG0, MSG1, MSG2, 3)
+        SHANI_ROUNDS(E0, E1, MSG0, MSG1, MSG2, MSG3, 3)
+
+        // rounds 68-71
+        E1 = _mm_sha1nexte_epu32(E1, MSG1);
+        E0 = ABCD;
+        MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+        ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 3);
+        MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+        // rounds 72-75
+        E0 = _mm_sha1nexte_epu32(E0, MSG2);
+        E1 = ABCD;
+        MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+        ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 3);
+
+        // rounds 76-79
+        E1 = _mm_sha1nexte_epu32(E1, MSG3);
+        E0 = ABCD;
+        ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 3);
+
+        E0 = _mm_sha1nexte_epu32(E0, E0_SAVE);
+        ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+
+        p += 64;
+    }
+
+    _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(ABCD, 0x1B));
+    state[4] = _mm_extract_epi32(E0, 3);
+}
+
+
+/*
+ * SHA-256 constants, in the order the SIMD code loads them
+ */
+static const uint32_t K256[64] __attribute__((aligned(16))) = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+
+/*
+ * SHA-256 AVX2
+ *
+ * W[t] + K[t] four words at a time: sigma0 and the W[t-16] / W[t-7] terms
+ * are computed for all four lanes, sigma1 two lanes at a time since
+ * W[t+2] depends on W[t].
+ */
+
+#define ror(value, bits) (((value) >> (bits)) | ((value) << (32 - (bits))))
+
+#define S0(a) (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22))
+#define S1(e) (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25))
+#define CH(e, f, g) ((g) ^ ((e) & ((f) ^ (g))))
+#define MAJ(a, b, c) (((a) & (b)) | ((c) & ((a) | (b))))
+
+#define R256(a, b, c, d, e, f, g, h, t) \
+    h += S1(e) + CH(e, f, g) + wk[t]; \
+    d += h; \
+    h += S0(a) + MAJ(a, b, c);
+
+#define R256_8(t) \
+    R256(A, B, C, D, E, F, G, H, t + 0) \
+    R256(H, A, B, C, D, E, F, G, t + 1) \
+    R256(G, H, A, B, C, D, E, F, t + 2) \
+    R256(F, G, H, A, B, C, D, E, t + 3) \
+    R256(E, F, G, H, A, B, C, D, t + 4) \
+    R256(D, E, F, G, H, A, B, C, t + 5) \
+    R256(C, D, E, F, G, H, A, B, t + 6) \
+    R256(B, C, D, E, F, G, H, A, t + 7)
+
+#define ROR_EPI32(x, n) _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - (n)))
+#define SIGMA0_EPI32(x) \
+    _mm_xor_si128(_mm_xor_si128(ROR_EPI32(x, 7), ROR_EPI32(x, 18)), _mm_srli_epi32(x, 3))
+#define SIGMA1_EPI32(x) \
+    _mm_xor_si128(_mm_xor_si128(ROR_EPI32(x, 17), ROR_EPI32(x, 19)), _mm_srli_epi32(x, 10))
+
+__attribute__((target("avx2,bmi2")))
+void SHA256_blocks_avx2(uint32_t* state, const uint8_t* p, int nblocks) {
+    const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+                                       4, 5, 6, 7, 0, 1, 2, 3);
+    const __m128i lo = _mm_set_epi32(0, 0, -1, -1);
+    const __m128i hi = _mm_set_epi32(-1, -1, 0, 0);
+    uint32_t wk[64] __attribute__((aligned(16)));
+    __m128i w[16];
+    uint32_t A, B, C, D, E, F, G, H;
+    int i;
+
+    while (nblocks-- > 0) {
+        for (i = 0; i < 4; i++) {
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 16 * i)), bswap);
+            _mm_store_si128((__m128i*)(wk + 4 * i),
+                            _mm_add_epi32(w[i], _mm_load_si128((const __m128i*)(K256 + 4 * i))));
+        }
+        for (; i < 16; i++) {
+            // W[t-16] + sigma0(W[t-15]) + W[t-7]
+            __m128i x = _mm_add_epi32(w[i - 4], SIGMA0_EPI32(_mm_alignr_epi8(w[i - 3], w[i - 4], 4)));
+            x = _mm_add_epi32(x, _mm_alignr_epi8(w[i - 1], w[i - 2], 4));
+            // + sigma1(W[t-2]), lanes 0 and 1
+            __m128i s = _mm_shuffle_epi32(w[i - 1], 0x0E);
+            x = _mm_add_epi32(x, _mm_and_si128(SIGMA1_EPI32(s), lo));
+            // + sigma1(W[t-2]), lanes 2 and 3 from the lanes just computed
+            s = _mm_shuffle_epi32(x, 0x44);
+            x = _mm_add_epi32(x, _mm_and_si128(SIGMA1_EPI32(s), hi));
+            w[i] = x;
+            _mm_store_si128((__m128i*)(wk + 4 * i),
+                            _mm_add_epi32(x, _mm_load_si128((const __m128i*)(K256 + 4 * i))));
+        }
+
+        A = state[0];
+        B = state[1];
+        C = state[2];
+        D = state[3];
+        E = state[4];
+        F = state[5];
+        G = state[6];
+        H = state[7];
+
+        R256_8(0)  R256_8(8)  R256_8(16) R256_8(24)
+        R256_8(32) R256_8(40) R256_8(48) R256_8(56)
+
+        state[0] += A;
+        state[1] += B;
+        state[2] += C;
+        state[3] += D;
+        state[4] += E;
+        state[5] += F;
+        state[6] += G;
+        state[7] += H;
+
+        p += 64;
+    }
+}
+
+
+/*
+ * SHA-256 SHA-NI
+ *
+ * The state is kept as ABEF / CDGH; each sha256rnds2 does two rounds, and
+ * the message schedule for the next group runs interleaved.
+ */
+
+#define SHANI256_ROUNDS(g, M0, Mprev, Mnext) \
+    MSG = _mm_add_epi32(M0, _mm_load_si128((const __m128i*)(K256 + 4 * (g)))); \
+    STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG); \
+    TMP = _mm_alignr_epi8(M0, Mprev, 4); \
+    Mnext = _mm_add_epi32(Mnext, TMP); \
+    Mnext = _mm_sha256msg2_epu32(Mnext, M0); \
+    MSG = _mm_shuffle_epi32(MSG, 0x0E); \
+    STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG); \
+    Mprev = _mm_sha256msg1_epu32(Mprev, M0);
+
+__attribute__((target("sha,sse4.1,ssse3")))
+void SHA256_blocks_shani(uint32_t* state, const uint8_t* p, int nblocks) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i STATE0, STATE1, MSG, TMP, ABEF_SAVE, CDGH_SAVE;
+    __m128i MSG0, MSG1, MSG2, MSG3;
+
+    TMP = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);    // CDAB
+    STATE1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B); // EFGH
+    STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);                                      // ABEF
+    STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0);                                   // CDGH
+
+    while (nblocks-- > 0) {
+        ABEF_SAVE = STATE0;
+        CDGH_SAVE = STATE1;
+
+        // rounds 0-3
+        MSG0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 0)), bswap);
+        MSG = _mm_add_epi32(MSG0, _mm_load_si128((const __m128i*)(K256 + 0)));
+        STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+        MSG = _mm_shuffle_epi32(MSG, 0x0E);
+        STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+
+        // rounds 4-7
+        MSG1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 16)), bswap);
+        MSG = _mm_add_epi32(MSG1, _mm_load_si128((const __m128i*)(K256 + 4)));
+        STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+        MSG = _mm_shuffle_epi32(MSG, 0x0E);
+        STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+        MSG0 = _mm_sha256msg1_epu32(MSG0, MSG1);
+
+        // rounds 8-11
+        MSG2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 32)), bswap);
+        MSG = _mm_add_epi32(MSG2, _mm_load_si128((const __m128i*)(K256 + 8)));
+        STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+        MSG = _mm_shuffle_epi32(MSG, 0x0E);
+        STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+        MSG1 = _mm_sha256msg1_epu32(MSG1, MSG2);
+
+        // rounds 12-59
+        MSG3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 48)), bswap);
+        SHANI256_ROUNDS(3, MSG3, MSG2, MSG0)
+        SHANI256_ROUNDS(4, MSG0, MSG3, MSG1)
+        SHANI256_ROUNDS(5, MSG1, MSG0, MSG2)
+        SHANI256_ROUNDS(6, MSG2, MSG1, MSG3)
+        SHANI256_ROUNDS(7, MSG3, MSG2, MSG0)
+        SHANI256_ROUNDS(8, MSG0, MSG3, MSG1)
+        SHANI256_ROUNDS(9, MSG1, MSG0, MSG2)
+        SHANI256_ROUNDS(10, MSG2, MSG1, MSG3)
+        SHANI256_ROUNDS(11, MSG3, MSG2, MSG0)
+        SHANI256_ROUNDS(12, MSG0, MSG3, MSG1)
+        SHANI256_ROUNDS(13, MSG1, MSG0, MSG2)
+        SHANI256_ROUNDS(14, MSG2, MSG1, MSG3)
+
+        // rounds 60-63
+        MSG = _mm_add_epi32(MSG3, _mm_load_si128((const __m128i*)(K256 + 60)));
+        STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+        MSG = _mm_shuffle_epi32(MSG, 0x0E);
+        STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+
+        STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+        STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+
+        p += 64;
+    }
+
+    TMP = _mm_shuffle_epi32(STATE0, 0x1B);         // FEBA
+    STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);      // DCHG
+    STATE0 = _mm_blend_epi16(TMP, STATE1, 0xF0);   // DCBA
+    STATE1 = _mm_alignr_epi8(STATE1, TMP, 8);      // ABEF
+    _mm_storeu_si128((__m128i*)&state[0], STATE0);
+    _mm_storeu_si128((__m128i*)&state[4], STATE1);
+}
+
+#endif // HAVE_SHA_X86
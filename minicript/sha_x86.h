@@ -0,0 +1,44 @@
+/* sha_x86.h
+**
+** Hardware accelerated SHA-1 / SHA-256 block functions for x86 / x86_64.
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+*/
+
+#ifndef MINICRIPT_SHA_X86_H_
+#define MINICRIPT_SHA_X86_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_SHA_X86 1
+
+#define X86_SSSE3   (1 << 0)
+#define X86_SSE41   (1 << 1)
+#define X86_AVX2    (1 << 2)
+#define X86_BMI2    (1 << 3)
+#define X86_SHA     (1 << 4)
+
+// cpuid (and xgetbv for AVX state) probe, cached after the first call.
+unsigned x86_cpu_features(void);
+
+// Each function hashes nblocks consecutive 64-byte blocks of p into state.
+void SHA1_blocks_ssse3(uint32_t* state, const uint8_t* p, int nblocks);
+void SHA1_blocks_avx2(uint32_t* state, const uint8_t* p, int nblocks);
+void SHA1_blocks_shani(uint32_t* state, const uint8_t* p, int nblocks);
+void SHA256_blocks_avx2(uint32_t* state, const uint8_t* p, int nblocks);
+void SHA256_blocks_shani(uint32_t* state, const uint8_t* p, int nblocks);
+#endif
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif  // MINICRIPT_SHA_X86_H_
@@ -0,0 +1,96 @@
+/* sha_selftest - known answers for every SHA backend the CPU supports
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "../minicript/sha.h"
+#include "../minicript/sha256.h"
+#include "../minicript/sha_mb.h"
+#include "../minicript/sha_x86.h"
+
+
+/*
+ * Every lane engine against SHA_update, on messages of every length
+ * around the block size, cut in several segments.
+ */
+#define MB_JOBS 40
+
+static int mb_selftest(void)
+{
+  static const char* engines[] = { "avx2", "sse2", "serial" };
+  static unsigned char msg[MB_JOBS * 8];
+  SHA_MB_SEG segs[MB_JOBS][3];
+  SHA_MB_JOB jobs[MB_JOBS];
+  uint8_t ref[MB_JOBS][SHA_DIGEST_SIZE];
+  const char* chosen = SHA_mb_backend();
+  SHA_CTX ctx;
+  int failed = 0;
+  unsigned e, i, j;
+
+  for (i = 0; i < sizeof(msg); i++)
+    msg[i] = i * 131 + 7;
+  for (i = 0; i < MB_JOBS; i++) {
+    int len = 8 * i;
+    segs[i][0] = (SHA_MB_SEG){ msg, len / 3 };
+    segs[i][1] = (SHA_MB_SEG){ msg + len / 3, len / 2 };
+    segs[i][2] = (SHA_MB_SEG){ msg + len / 3 + len / 2, len - len / 3 - len / 2 };
+    SHA_init(&ctx);
+    SHA_update(&ctx, msg, len);
+    memcpy(ref[i], SHA_final(&ctx), SHA_DIGEST_SIZE);
+  }
+
+  for (e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+    if (SHA_mb_set_backend(engines[e]))
+      continue;
+    for (j = 1; j <= MB_JOBS; j++) {
+      for (i = 0; i < j; i++) {
+        jobs[i].segs = segs[i];
+        jobs[i].nsegs = 3;
+      }
+      SHA_mb_hash(jobs, j);
+      for (i = 0; i < j; i++)
+        if (memcmp(jobs[i].digest, ref[i], SHA_DIGEST_SIZE)) {
+          printf("sha1 %s: FAILED (%u jobs)\n", engines[e], j);
+          failed = 1;
+          break;
+        }
+    }
+  }
+  SHA_mb_set_backend(chosen);
+
+#ifdef HAVE_SHA_X86
+  // SHA-NI hashes one message faster than any lanes, AVX2 lanes beat SSE2
+  if (!(x86_cpu_features() & X86_SHA) && (x86_cpu_features() & X86_AVX2) &&
+      (SHA_mb_lanes() != 8)) {
+    printf("sha1 lanes: FAILED (%s chosen on an AVX2 CPU)\n", chosen);
+    failed = 1;
+  }
+#endif
+  return failed;
+}
+
+
+int main(void)
+{
+  int failed = 0;
+
+  if (SHA_selftest()) {
+    printf("sha1: FAILED\n");
+    failed = 1;
+  }
+  if (SHA256_selftest()) {
+    printf("sha256: FAILED\n");
+    failed = 1;
+  }
+  if (mb_selftest())
+    failed = 1;
+  if (!failed)
+    printf("sha_selftest: OK (sha1 %s, sha256 %s, lanes %s)\n", SHA_backend(), SHA256_backend(),
+           SHA_mb_backend());
+  return failed;
+}
@@ -0,0 +1,103 @@
+#!/bin/sh
+# unpack_initrd - --unpack-initrd on hostile archives
+#
+# usage: tests/unpack_initrd.sh
+#
+# Builds small gzip compressed newc archives meant to write out of the
+# output directory (through "..", absolute names, or a symbolic link that
+# a later entry goes through) and checks that they are refused and that
+# nothing out of the directory changed. A plain archive with a hard link
+# and directory modes must unpack.
+
+set -e
+
+ABOOTIMG=${ABOOTIMG:-./abootimg}
+TMP=$(mktemp -d)
+trap 'chmod -R u+rwx "$TMP"; rm -rf "$TMP"' EXIT
+failed=0
+
+# newc archive on stdout from "name mode ino nlink data" lines (mode in
+# octal; data is the content of files and the target of symbolic links)
+newc() {
+  off=0
+  while read -r name mode ino nlink data; do
+    [ "$data" = "-" ] && data=
+    size=$(printf %s "$data" | wc -c)
+    nsize=$(( ${#name} + 1 ))
+    printf '070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X' \
+      "$ino" "$((0$mode))" 0 0 "$nlink" 0 "$size" 0 0 0 0 "$nsize" 0
+    printf '%s\0' "$name"
+    off=$(( off + 110 + nsize ))
+    head -c $(( -off & 3 )) /dev/zero
+    off=$(( off + (-off & 3) ))
+    printf %s "$data"
+    off=$(( off + size ))
+    head -c $(( -off & 3 )) /dev/zero
+    off=$(( off + (-off & 3) ))
+  done
+  printf '070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X' \
+    0 0 0 0 1 0 0 0 0 0 0 11 0
+  printf 'TRAILER!!!\0'
+  head -c $(( -(off + 121) & 3 )) /dev/zero
+}
+
+# refused <name>: the archive on stdin must not unpack
+refused() {
+  newc | gzip -n > "$TMP/$1.img"
+  rm -rf "$TMP/out"
+  if "$ABOOTIMG" --unpack-initrd "$TMP/$1.img" "$TMP/out" >/dev/null 2>&1; then
+    echo "$1: unpacked"
+    failed=1
+  fi
+}
+
+mkdir -m 0700 "$TMP/victim"
+echo secret > "$TMP/victim/file"
+
+refused dotdot <<EOF
+../escaped 0100644 1 1 x
+EOF
+refused absolute <<EOF
+$TMP/escaped 0100644 1 1 x
+EOF
+refused dir_over_symlink <<EOF
+s 0120777 1 1 $TMP/victim
+s 040777 2 1 -
+EOF
+refused file_through_symlink <<EOF
+s 0120777 1 1 $TMP/victim
+s/file 0100644 2 1 changed
+EOF
+refused link_through_symlink <<EOF
+s 0120777 1 1 $TMP/victim
+a 0100644 2 2 x
+s/a 0100644 2 2 -
+EOF
+
+[ -e "$TMP/escaped" ] && { echo "file written out of the directory"; failed=1; }
+[ "$(stat -c %a "$TMP/victim")" = 700 ] || { echo "victim mode changed"; failed=1; }
+[ "$(cat "$TMP/victim/file")" = secret ] || { echo "victim file changed"; failed=1; }
+[ -e "$TMP/victim/a" ] && { echo "link created out of the directory"; failed=1; }
+
+newc > "$TMP/plain.cpio" <<EOF
+d 040750 1 2 -
+d/sub 040555 2 2 -
+d/sub/f 0100640 3 2 hello
+d/g 0100640 3 2 -
+l 0120777 4 1 d/sub/f
+EOF
+gzip -n < "$TMP/plain.cpio" > "$TMP/plain.img"
+rm -rf "$TMP/out"
+if ! "$ABOOTIMG" --unpack-initrd "$TMP/plain.img" "$TMP/out" >/dev/null; then
+  echo "plain: not unpacked"
+  failed=1
+elif [ "$(stat -c %a "$TMP/out/d")" != 750 ] ||
+     [ "$(stat -c %a "$TMP/out/d/sub")" != 555 ] ||
+     [ "$(stat -c %i "$TMP/out/d/sub/f")" != "$(stat -c %i "$TMP/out/d/g")" ] ||
+     [ "$(cat "$TMP/out/l")" != hello ]; then
+  echo "plain: wrong tree"
+  failed=1
+fi
+
+[ "$failed" -eq 0 ] && echo "unpack_initrd: OK"
+exit "$failed"
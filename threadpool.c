@@ -0,0 +1,141 @@
+/* threadpool.c - run a set of independent tasks on a few threads
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+
+/*
+ * Share of the tasks of one worker: [head, tail). The owner takes from
+ * the head, thieves from the tail.
+ */
+typedef struct
+{
+  pthread_mutex_t lock;
+  int          head;
+  int          tail;
+} t_deque;
+
+typedef struct
+{
+  tp_task      task;
+  void*        arg;
+  t_deque*     deques;
+  int          nworkers;
+} t_pool;
+
+typedef struct
+{
+  t_pool*      pool;
+  int          id;
+  pthread_t    thread;
+} t_worker;
+
+
+static int take(t_deque* d)
+{
+  int i = -1;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->head < d->tail)
+    i = d->head++;
+  pthread_mutex_unlock(&d->lock);
+  return i;
+}
+
+static int steal(t_deque* d)
+{
+  int i = -1;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->head < d->tail)
+    i = --d->tail;
+  pthread_mutex_unlock(&d->lock);
+  return i;
+}
+
+static void* work(void* arg)
+{
+  t_worker* w = arg;
+  t_pool* p = w->pool;
+  int i, v;
+
+  for (;;) {
+    i = take(&p->deques[w->id]);
+
+    // own share done, look for work in the others, next one first
+    for (v = 1; (i == -1) && (v < p->nworkers); v++)
+      i = steal(&p->deques[(w->id + v) % p->nworkers]);
+
+    if (i == -1)
+      return NULL;
+    p->task(p->arg, i);
+  }
+}
+
+
+int tp_default_threads(void)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+}
+
+int tp_run(tp_task task, void* arg, int n, int nthreads)
+{
+  t_pool pool;
+  t_worker* workers;
+  int i;
+
+  if (nthreads <= 0)
+    nthreads = tp_default_threads();
+  if (nthreads > n)
+    nthreads = n;
+  if (!n)
+    return 0;
+
+  pool.task = task;
+  pool.arg = arg;
+  pool.nworkers = nthreads;
+  pool.deques = calloc(nthreads, sizeof(*pool.deques));
+  workers = calloc(nthreads, sizeof(*workers));
+  if (!pool.deques || !workers) {
+    free(pool.deques);
+    free(workers);
+    return -1;
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    pthread_mutex_init(&pool.deques[i].lock, NULL);
+    pool.deques[i].head = (long long)n * i / nthreads;
+    pool.deques[i].tail = (long long)n * (i + 1) / nthreads;
+  }
+
+  // the calling thread is worker 0; the share of a worker which could
+  // not be started is stolen by the others
+  for (i = 1; i < nthreads; i++) {
+    workers[i].pool = &pool;
+    workers[i].id = i;
+    if (pthread_create(&workers[i].thread, NULL, work, &workers[i]))
+      workers[i].pool = NULL;
+  }
+  workers[0].pool = &pool;
+  workers[0].id = 0;
+  work(&workers[0]);
+
+  for (i = 1; i < nthreads; i++)
+    if (workers[i].pool)
+      pthread_join(workers[i].thread, NULL);
+
+  for (i = 0; i < nthreads; i++)
+    pthread_mutex_destroy(&pool.deques[i].lock);
+  free(pool.deques);
+  free(workers);
+  return 0;
+}
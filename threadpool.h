@@ -0,0 +1,30 @@
+/* threadpool.h - run a set of independent tasks on a few threads
+ *
+ * Each worker starts with its own share of the tasks, runs them from the
+ * front, and when it runs out steals from the back of the share of
+ * another worker, so that a few slow tasks do not leave threads idle.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+typedef void (*tp_task)(void* arg, int i);
+
+/*
+ * Calls task(arg, i) for every i in [0, n), on up to nthreads threads
+ * (0 for one per online CPU). Returns once every task is done, or -1 if
+ * out of memory.
+ */
+int tp_run(tp_task task, void* arg, int n, int nthreads);
+
+/*
+ * Number of threads tp_run uses for nthreads == 0.
+ */
+int tp_default_threads(void);
+
+#endif // THREADPOOL_H_